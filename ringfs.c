@@ -18,9 +18,253 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
 
+#ifndef RINGFS_BATCH_BUFFER_SIZE
+/** Stack buffer used by ringfs_append_batch() to merge programs, in bytes. */
+#define RINGFS_BATCH_BUFFER_SIZE 256
+#endif
+
+#ifndef RINGFS_CONCURRENT_WAIT
+/** Called while ringfs_append_concurrent() waits for other producers. */
+#define RINGFS_CONCURRENT_WAIT() do {} while (0)
+#endif
+
+#ifndef RINGFS_MAX_PROGRAM_UNIT
+/** Largest unit ringfs_set_program_unit() takes. Sets the size of stack buffers. */
+#define RINGFS_MAX_PROGRAM_UNIT 32
+#endif
+
+#ifndef RINGFS_DISCARD_MARKS
+/** Discard marks per sector header. Part of the on-flash format. */
+#define RINGFS_DISCARD_MARKS 4
+#endif
+
+/**
+ * Small values are stored with their complement in the upper half of the word,
+ * so that a torn program is recognized.
+ */
+static uint32_t _check_encode(int value)
+{
+    return ((uint32_t) value & 0xFFFF) | ((~(uint32_t) value & 0xFFFF) << 16);
+}
+
+static int _check_decode(uint32_t word, int *value)
+{
+    if ((word >> 16) != (~word & 0xFFFF))
+        return -1;
+    *value = word & 0xFFFF;
+    return 0;
+}
+
+/**
+ * @defgroup flash
+ * @{
+ */
+
+#ifdef RINGFS_STATS
+/** Attribute the flash ops that follow to an API call. */
+#define STATS_CALL(fs, call) ((fs)->stats_call = (call))
+#define STATS_OPS(fs) (&(fs)->stats.calls[(fs)->stats_call])
+#else
+#define STATS_CALL(fs, call) do {} while (0)
+#endif
+
+/* Every flash op goes through here, to be counted with RINGFS_STATS. */
+
+static ssize_t _flash_read_uncached(struct ringfs *fs, struct ringfs_flash_partition *flash,
+        int address, void *data, size_t size)
+{
+#ifdef RINGFS_STATS
+    STATS_OPS(fs)->reads++;
+    STATS_OPS(fs)->read_bytes += size;
+#else
+    (void) fs;
+#endif
+    return flash->read(flash, address, data, size);
+}
+
+/** Drop the read cache windows that overlap a range of the partition. */
+static void _cache_invalidate(struct ringfs *fs, int address, int size)
+{
+    for (int i=0; i<fs->cache_windows; i++)
+        if (fs->cache_address[i] >= 0 && fs->cache_address[i] < address + size &&
+                address < fs->cache_address[i] + fs->cache_window)
+            fs->cache_address[i] = -1;
+}
+
+/** Find the window holding an aligned address, filling one if needed. */
+static const uint8_t *_cache_window(struct ringfs *fs, int address)
+{
+    for (int i=0; i<fs->cache_windows; i++)
+        if (fs->cache_address[i] == address)
+            return fs->cache + i * fs->cache_window;
+
+    int i = fs->cache_next;
+    fs->cache_next = (fs->cache_next + 1) % fs->cache_windows;
+    uint8_t *window = fs->cache + i * fs->cache_window;
+    if (_flash_read_uncached(fs, fs->flash, address, window, fs->cache_window) != fs->cache_window) {
+        fs->cache_address[i] = -1;
+        return NULL;
+    }
+    fs->cache_address[i] = address;
+    return window;
+}
+
+static ssize_t _flash_read(struct ringfs *fs, struct ringfs_flash_partition *flash,
+        int address, void *data, size_t size)
+{
+    if (fs->cache && flash == fs->flash && size > 0) {
+        int start = address - address % fs->cache_window;
+        if (address + (int) size <= start + fs->cache_window) {
+            const uint8_t *window = _cache_window(fs, start);
+            if (window) {
+                memcpy(data, window + (address - start), size);
+                return size;
+            }
+        }
+    }
+
+    return _flash_read_uncached(fs, flash, address, data, size);
+}
+
+static ssize_t _flash_program(struct ringfs *fs, struct ringfs_flash_partition *flash,
+        int address, const void *data, size_t size)
+{
+    if (flash == fs->flash)
+        _cache_invalidate(fs, address, size);
+#ifdef RINGFS_STATS
+    STATS_OPS(fs)->programs++;
+    STATS_OPS(fs)->program_bytes += size;
+#else
+    (void) fs;
+#endif
+    return flash->program(flash, address, data, size);
+}
+
+static int _flash_sector_erase(struct ringfs *fs, struct ringfs_flash_partition *flash, int address)
+{
+    if (flash == fs->flash)
+        _cache_invalidate(fs, address - address % flash->sector_size, flash->sector_size);
+#ifdef RINGFS_STATS
+    STATS_OPS(fs)->erases++;
+#else
+    (void) fs;
+#endif
+    return flash->sector_erase(flash, address);
+}
+
+static int _flash_sector_erase_start(struct ringfs *fs, struct ringfs_flash_partition *flash, int address)
+{
+    /* Dropped again once done: reads meanwhile may see it half way. */
+    if (flash == fs->flash)
+        _cache_invalidate(fs, address - address % flash->sector_size, flash->sector_size);
+#ifdef RINGFS_STATS
+    STATS_OPS(fs)->erases++;
+#else
+    (void) fs;
+#endif
+    return flash->sector_erase_start(flash, address);
+}
+
+/** Make the programs so far durable before going on, if the driver holds them back. */
+static int _flash_sync(struct ringfs *fs)
+{
+    if (!fs->flash->sync)
+        return 0;
+    return fs->flash->sync(fs->flash);
+}
+
+/**
+ * @}
+ * @defgroup unit
+ * @{
+ */
+
+/** Round a field size up to whole program units. */
+static int _unit_round(struct ringfs *fs, int size)
+{
+    if (!fs->program_unit)
+        return size;
+    return (size + fs->program_unit - 1) / fs->program_unit * fs->program_unit;
+}
+
+/** Program a field that's written once, padding it to whole program units. */
+static ssize_t _unit_program(struct ringfs *fs, struct ringfs_flash_partition *flash,
+        int address, const void *data, size_t size)
+{
+    int whole = size - size % (fs->program_unit ? fs->program_unit : 1);
+    if (whole == (int) size)
+        return _flash_program(fs, flash, address, data, size);
+
+    uint8_t tail[RINGFS_MAX_PROGRAM_UNIT];
+    memset(tail, 0xFF, fs->program_unit);
+    memcpy(tail, (const uint8_t *) data + whole, size - whole);
+    if (whole > 0 && _flash_program(fs, flash, address, data, whole) < 0)
+        return -1;
+    if (_flash_program(fs, flash, address + whole, tail, fs->program_unit) < 0)
+        return -1;
+    return size;
+}
+
+/*
+ * Status words step through their states by clearing one more byte at a time.
+ * With a program unit, byte i of the word gets unit i to itself instead, which
+ * is programmed to zeros once. The furthest programmed unit tells the state.
+ * Slot statuses take three levels, sector statuses four.
+ */
+
+static int _status_size(struct ringfs *fs, int levels)
+{
+    return fs->program_unit ? levels * fs->program_unit : (int) sizeof(uint32_t);
+}
+
+static uint32_t _status_decode(struct ringfs *fs, const uint8_t *bytes, int levels)
+{
+    uint32_t status = 0xFFFFFFFF;
+
+    if (!fs->program_unit) {
+        memcpy(&status, bytes, sizeof(status));
+        return status;
+    }
+
+    for (int level=0; level<levels; level++) {
+        for (int i=0; i<fs->program_unit; i++) {
+            if (bytes[level * fs->program_unit + i] != 0xFF) {
+                status = level < 3 ? 0xFFFFFFFF << (8 * (level + 1)) : 0;
+                break;
+            }
+        }
+    }
+    return status;
+}
+
+static int _status_read(struct ringfs *fs, int address, int levels, uint32_t *status)
+{
+    uint8_t bytes[4 * RINGFS_MAX_PROGRAM_UNIT];
+    int ret = _flash_read(fs, fs->flash, address, bytes, _status_size(fs, levels));
+    *status = _status_decode(fs, bytes, levels);
+    return ret;
+}
+
+static int _status_write(struct ringfs *fs, int address, uint32_t status)
+{
+    if (!fs->program_unit)
+        return _flash_program(fs, fs->flash, address, &status, sizeof(status));
+
+    /* The level is the index of the highest zero byte. */
+    int level = 0;
+    while (level < 3 && ((status >> (8 * (level + 1))) & 0xFF) == 0)
+        level++;
+
+    uint8_t zeros[RINGFS_MAX_PROGRAM_UNIT];
+    memset(zeros, 0, fs->program_unit);
+    return _flash_program(fs, fs->flash, address + level * fs->program_unit,
+            zeros, fs->program_unit);
+}
 
 /**
+ * @}
  * @defgroup sector
  * @{
  */
@@ -31,6 +275,7 @@ enum sector_status {
     SECTOR_IN_USE     = 0xFFFF0000, /**< Sector contains valid data. */
     SECTOR_ERASING    = 0xFF000000, /**< Sector should be erased. */
     SECTOR_FORMATTING = 0x00000000, /**< The entire partition is being formatted. */
+    SECTOR_UNKNOWN    = 0x0000FFFF, /**< Sector table only: not read from flash yet. */
 };
 
 struct sector_header {
@@ -38,37 +283,311 @@ struct sector_header {
     uint32_t version;
 };
 
+/** Keys in a sector, see RINGFS_FEATURE_KEY_RANGE. Left ERASED until sealed. */
+struct key_range {
+    uint32_t min;
+    uint32_t max;
+    uint32_t check;     /**< ~(min ^ max), catches torn programs. */
+};
+
 static int _sector_address(struct ringfs *fs, int sector_offset)
 {
     return (fs->flash->sector_offset + sector_offset) * fs->flash->sector_size;
 }
 
+/** Size of the optional sector header field that belongs to a feature. */
+static int _sector_field_size(struct ringfs *fs, uint32_t feature)
+{
+    switch (feature) {
+        case RINGFS_FEATURE_DISCARD_MARKS: return RINGFS_DISCARD_MARKS * _unit_round(fs, sizeof(uint32_t));
+        case RINGFS_FEATURE_SEQUENCE: return _unit_round(fs, 2 * sizeof(uint32_t));
+        case RINGFS_FEATURE_KEY_RANGE: return _unit_round(fs, sizeof(struct key_range));
+        case RINGFS_FEATURE_ERASE_COUNT: return _unit_round(fs, 2 * sizeof(uint32_t));
+        default: return 0;
+    }
+}
+
+/** The version follows the status, which spreads over four units with a program unit. */
+static int _sector_version_offset(struct ringfs *fs)
+{
+    if (!fs->program_unit)
+        return offsetof(struct sector_header, version);
+    return _status_size(fs, 4);
+}
+
+/**
+ * Offset of an optional sector header field, or the size of the whole header
+ * for feature 0. Fields follow struct sector_header in feature bit order.
+ */
+static int _sector_field_offset(struct ringfs *fs, uint32_t feature)
+{
+    int offset = _sector_version_offset(fs) + _unit_round(fs, sizeof(uint32_t));
+    for (uint32_t f = 1; f != 0 && f != feature; f <<= 1)
+        if (fs->features & f)
+            offset += _sector_field_size(fs, f);
+    return offset;
+}
+
+/** Read the status and version of a sector, bypassing the sector table. */
+static int _sector_get_header(struct ringfs *fs, int sector, struct sector_header *header)
+{
+    int addr = _sector_address(fs, sector);
+
+    if (!fs->program_unit)
+        return _flash_read(fs, fs->flash, addr, header, sizeof(*header));
+
+    _status_read(fs, addr + offsetof(struct sector_header, status), 4, &header->status);
+    return _flash_read(fs, fs->flash, addr + _sector_version_offset(fs),
+            &header->version, sizeof(header->version));
+}
+
 static int _sector_get_status(struct ringfs *fs, int sector, uint32_t *status)
 {
-    return fs->flash->read(fs->flash,
+    if (fs->sectors && fs->sectors[sector].status != SECTOR_UNKNOWN) {
+        *status = fs->sectors[sector].status;
+        return sizeof(*status);
+    }
+
+    int ret = _status_read(fs,
             _sector_address(fs, sector) + offsetof(struct sector_header, status),
-            status, sizeof(*status));
+            4, status);
+    if (fs->sectors)
+        fs->sectors[sector].status = *status;
+    return ret;
 }
 
 static int _sector_set_status(struct ringfs *fs, int sector, uint32_t status)
 {
-    return fs->flash->program(fs->flash,
-            _sector_address(fs, sector) + offsetof(struct sector_header, status),
-            &status, sizeof(status));
+    if (fs->sectors)
+        fs->sectors[sector].status = status;
+
+    /* Each state vouches for the header fields and data written before. */
+    _flash_sync(fs);
+    int addr = _sector_address(fs, sector) + offsetof(struct sector_header, status);
+
+    /* Units can't be programmed twice, and states may be set again, say by
+     * a format that was cut short. Skip states the sector is already past. */
+    if (fs->program_unit) {
+        uint32_t current;
+        _status_read(fs, addr, 4, &current);
+        if ((current & ~status) == 0)
+            return sizeof(status);
+    }
+
+    return _status_write(fs, addr, status);
 }
 
-static int _sector_free(struct ringfs *fs, int sector)
+/** The erase count is stored along with its complement. */
+static int _sector_get_erase_count(struct ringfs *fs, int sector, uint32_t *count)
+{
+    uint32_t words[2];
+    _flash_read(fs, fs->flash,
+            _sector_address(fs, sector) + _sector_field_offset(fs, RINGFS_FEATURE_ERASE_COUNT),
+            words, sizeof(words));
+    if (words[1] != ~words[0])
+        return -1;
+    *count = words[0];
+    return 0;
+}
+
+/**
+ * Read the erase count of a sector about to be erased, plus one. A count lost
+ * to a power cut right after an erase is taken from the previous sector:
+ * sectors are erased in ring order, so that one has just been erased as many
+ * times as this one is about to be.
+ */
+static uint32_t _sector_next_erase_count(struct ringfs *fs, int sector)
+{
+    uint32_t count;
+
+    if (!(fs->features & RINGFS_FEATURE_ERASE_COUNT))
+        return 0;
+    if (_sector_get_erase_count(fs, sector, &count) == 0)
+        return count + 1;
+
+    int previous = (sector + fs->flash->sector_count - 1) % fs->flash->sector_count;
+    if (_sector_get_erase_count(fs, previous, &count) == 0)
+        return count;
+    return 1;
+}
+
+/** Finish freeing an erased sector, given its new erase count. */
+static int _sector_free_finish(struct ringfs *fs, int sector, uint32_t erase_count)
 {
     int sector_addr = _sector_address(fs, sector);
-    _sector_set_status(fs, sector, SECTOR_ERASING);
-    fs->flash->sector_erase(fs->flash, sector_addr);
-    fs->flash->program(fs->flash,
-            sector_addr + offsetof(struct sector_header, version),
+    _unit_program(fs, fs->flash,
+            sector_addr + _sector_version_offset(fs),
             &fs->version, sizeof(fs->version));
+    if (fs->features & RINGFS_FEATURE_ERASE_COUNT) {
+        uint32_t words[2] = { erase_count, ~erase_count };
+        _unit_program(fs, fs->flash,
+                sector_addr + _sector_field_offset(fs, RINGFS_FEATURE_ERASE_COUNT),
+                words, sizeof(words));
+    }
     _sector_set_status(fs, sector, SECTOR_FREE);
+    if (fs->sectors)
+        fs->sectors[sector].valid = 0;
+    return 0;
+}
+
+static int _sector_free(struct ringfs *fs, int sector)
+{
+    uint32_t erase_count;
+
+    if (fs->erasing == sector) {
+        /* Already being erased in the background; wait for it. */
+        while (fs->flash->busy(fs->flash) > 0);
+        _cache_invalidate(fs, _sector_address(fs, sector), fs->flash->sector_size);
+        fs->erasing = -1;
+        erase_count = fs->erasing_count;
+    } else {
+        erase_count = _sector_next_erase_count(fs, sector);
+        _sector_set_status(fs, sector, SECTOR_ERASING);
+        _flash_sector_erase(fs, fs->flash, _sector_address(fs, sector));
+    }
+    return _sector_free_finish(fs, sector, erase_count);
+}
+
+/** Account for objects committed to a sector. */
+static void _sector_add_valid(struct ringfs *fs, int sector, int count)
+{
+    if (fs->sectors && fs->sectors[sector].valid >= 0)
+        fs->sectors[sector].valid += count;
+}
+
+/** Discard marks hold the first slot not discarded yet; torn ones are ignored. */
+static int _sector_mark_address(struct ringfs *fs, int sector, int index)
+{
+    return _sector_address(fs, sector) +
+           _sector_field_offset(fs, RINGFS_FEATURE_DISCARD_MARKS) +
+           index * _unit_round(fs, sizeof(uint32_t));
+}
+
+static int _sector_set_mark(struct ringfs *fs, int sector, int index, int slot)
+{
+    uint32_t mark = _check_encode(slot);
+    return _unit_program(fs, fs->flash, _sector_mark_address(fs, sector, index),
+            &mark, sizeof(mark));
+}
+
+/** Find the first slot not discarded according to the marks, and how many are used. */
+static int _sector_get_mark(struct ringfs *fs, int sector, int *used)
+{
+    uint32_t marks[RINGFS_DISCARD_MARKS];
+    int slot = 0;
+
+    /* With a program unit, each mark has a unit to itself. */
+    if (fs->program_unit) {
+        for (int i=0; i<RINGFS_DISCARD_MARKS; i++)
+            _flash_read(fs, fs->flash, _sector_mark_address(fs, sector, i),
+                    &marks[i], sizeof(marks[i]));
+    } else {
+        _flash_read(fs, fs->flash, _sector_mark_address(fs, sector, 0), marks, sizeof(marks));
+    }
+
+    *used = 0;
+    for (int i=0; i<RINGFS_DISCARD_MARKS && marks[i] != 0xFFFFFFFF; i++) {
+        int value;
+        if (_check_decode(marks[i], &value) == 0 && value > slot)
+            slot = value;
+        *used = i + 1;
+    }
+
+    return slot < fs->slots_per_sector ? slot : fs->slots_per_sector;
+}
+
+/** The sequence number is stored along with its complement. */
+static int _sector_set_sequence(struct ringfs *fs, int sector, uint32_t sequence)
+{
+    uint32_t words[2] = { sequence, ~sequence };
+    int address = _sector_address(fs, sector) + _sector_field_offset(fs, RINGFS_FEATURE_SEQUENCE);
+
+    /* Power loss may have left the number on a sector that never got to be
+     * IN_USE. Program units can't take it twice, so look first, and start
+     * the sector over if it holds another one. */
+    if (fs->program_unit) {
+        uint32_t current[2];
+        _flash_read(fs, fs->flash, address, current, sizeof(current));
+        if (current[0] == words[0] && current[1] == words[1])
+            return 0;
+        if (current[0] != 0xFFFFFFFF || current[1] != 0xFFFFFFFF)
+            _sector_free(fs, sector);
+    }
+
+    return _unit_program(fs, fs->flash, address, words, sizeof(words));
+}
+
+static int _sector_get_sequence(struct ringfs *fs, int sector, uint32_t *sequence)
+{
+    uint32_t words[2];
+    _flash_read(fs, fs->flash,
+            _sector_address(fs, sector) + _sector_field_offset(fs, RINGFS_FEATURE_SEQUENCE),
+            words, sizeof(words));
+    if (words[1] != ~words[0])
+        return -1;
+    *sequence = words[0];
+    return 0;
+}
+
+static int _sector_set_range(struct ringfs *fs, int sector, uint32_t min, uint32_t max)
+{
+    struct key_range range = { min, max, ~(min ^ max) };
+    return _unit_program(fs, fs->flash,
+            _sector_address(fs, sector) + _sector_field_offset(fs, RINGFS_FEATURE_KEY_RANGE),
+            &range, sizeof(range));
+}
+
+/**
+ * Get the range of keys in a sector: from RAM for the sector being written,
+ * from the header otherwise. Fails if the range isn't known.
+ */
+static int _sector_get_range(struct ringfs *fs, int sector, uint32_t *min, uint32_t *max)
+{
+    if (!fs->key)
+        return -1;
+    if (sector == fs->key_sector) {
+        *min = fs->key_min;
+        *max = fs->key_max;
+        return 0;
+    }
+
+    struct key_range range;
+    _flash_read(fs, fs->flash,
+            _sector_address(fs, sector) + _sector_field_offset(fs, RINGFS_FEATURE_KEY_RANGE),
+            &range, sizeof(range));
+    if ((range.min == 0xFFFFFFFF && range.max == 0xFFFFFFFF && range.check == 0xFFFFFFFF) ||
+            range.check != ~(range.min ^ range.max))
+        return -1;
+    *min = range.min;
+    *max = range.max;
     return 0;
 }
 
+/** Whether a sector may hold keys between min and max. */
+static bool _sector_in_range(struct ringfs *fs, int sector, uint32_t min, uint32_t max)
+{
+    uint32_t sector_min, sector_max;
+    if (_sector_get_range(fs, sector, &sector_min, &sector_max) != 0)
+        return true;
+    return sector_min <= max && sector_max >= min;
+}
+
+/** Take an appended object's key into account for the write sector. */
+static void _sector_add_key(struct ringfs *fs, const void *object, int size)
+{
+    if (!(fs->features & RINGFS_FEATURE_KEY_RANGE) || fs->key_sector < 0)
+        return;
+
+    /* Without a callback, every key may be there. */
+    uint32_t key_min = 0, key_max = 0xFFFFFFFF;
+    if (fs->key)
+        key_min = key_max = fs->key(object, size);
+    if (key_min < fs->key_min)
+        fs->key_min = key_min;
+    if (key_max > fs->key_max)
+        fs->key_max = key_max;
+}
+
 /**
  * @}
  * @defgroup slot
@@ -88,331 +607,2195 @@ struct slot_header {
 
 static int _slot_address(struct ringfs *fs, struct ringfs_loc *loc)
 {
+    /* Variable length records are addressed by byte offset. */
+    if (fs->features & RINGFS_FEATURE_VARIABLE)
+        return _sector_address(fs, loc->sector) + fs->sector_header_size + loc->slot;
+
     return _sector_address(fs, loc->sector) +
-           sizeof(struct sector_header) +
-           (sizeof(struct slot_header) + fs->object_size) * loc->slot;
+           fs->sector_header_size +
+           fs->slot_size * loc->slot;
 }
 
 static int _slot_get_status(struct ringfs *fs, struct ringfs_loc *loc, uint32_t *status)
 {
-    return fs->flash->read(fs->flash,
+    return _status_read(fs,
             _slot_address(fs, loc) + offsetof(struct slot_header, status),
-            status, sizeof(*status));
+            3, status);
 }
 
+/**
+ * A slot is RESERVED before its payload is written, and VALID only after, so
+ * both order against the payload.
+ */
 static int _slot_set_status(struct ringfs *fs, struct ringfs_loc *loc, uint32_t status)
 {
-    return fs->flash->program(fs->flash, 
+    if (status == SLOT_VALID)
+        _flash_sync(fs);
+    int ret = _status_write(fs,
             _slot_address(fs, loc) + offsetof(struct slot_header, status),
-            &status, sizeof(status));
+            status);
+    if (status == SLOT_RESERVED)
+        _flash_sync(fs);
+    return ret;
+}
+
+/** Find the first ERASED slot in a sector, or slots_per_sector if it's full. */
+static int _slot_find_erased(struct ringfs *fs, int sector)
+{
+    int lo = 0;
+    int hi = fs->slots_per_sector;
+
+    while (lo < hi) {
+        struct ringfs_loc loc = { sector, lo + (hi - lo) / 2 };
+        uint32_t status;
+        _slot_get_status(fs, &loc, &status);
+        if (status == SLOT_ERASED)
+            hi = loc.slot;
+        else
+            lo = loc.slot + 1;
+    }
+
+    return lo;
+}
+
+/**
+ * Move a location over the GARBAGE slots that follow it, stopping at the first
+ * other slot or at the given end slot. Discards happen in order, so a valid
+ * slot is never followed by a GARBAGE one and the run can be binary searched.
+ */
+static void _slot_skip_garbage(struct ringfs *fs, struct ringfs_loc *loc, int end)
+{
+    int lo = loc->slot;
+    int hi = end;
+    uint32_t status;
+
+    if (lo >= hi)
+        return;
+
+    /* Fully discarded sectors are common; one read tells them apart. */
+    struct ringfs_loc last = { loc->sector, hi - 1 };
+    _slot_get_status(fs, &last, &status);
+    if (status == SLOT_GARBAGE) {
+        loc->slot = hi;
+        return;
+    }
+
+    while (lo < hi) {
+        struct ringfs_loc mid = { loc->sector, lo + (hi - lo) / 2 };
+        _slot_get_status(fs, &mid, &status);
+        if (status == SLOT_GARBAGE)
+            lo = mid.slot + 1;
+        else
+            hi = mid.slot;
+    }
+
+    loc->slot = lo;
+}
+
+/**
+ * @}
+ * @defgroup loc
+ * @{
+ */
+
+static bool _loc_equal(const struct ringfs_loc *a, const struct ringfs_loc *b)
+{
+    return (a->sector == b->sector) && (a->slot == b->slot);
+}
+
+/** Advance a location to the beginning of the next sector. */
+static void _loc_advance_sector(struct ringfs *fs, struct ringfs_loc *loc)
+{
+    loc->slot = 0;
+    loc->sector++;
+    if (loc->sector >= fs->flash->sector_count)
+        loc->sector = 0;
+}
+
+/** Advance a location to the next slot, advancing the sector too if needed. */
+static void _loc_advance_slot(struct ringfs *fs, struct ringfs_loc *loc)
+{
+    loc->slot++;
+    if (loc->slot >= fs->slots_per_sector)
+        _loc_advance_sector(fs, loc);
+}
+
+/** Advance the cursor by one slot, counting valid objects it passes. */
+static void _cursor_advance_slot(struct ringfs *fs, bool valid)
+{
+    if (valid && fs->cursor_valid >= 0)
+        fs->cursor_valid++;
+    _loc_advance_slot(fs, &fs->cursor);
+    if (fs->cursor.slot == 0)
+        fs->cursor_valid = 0;
+}
+
+/**
+ * The write head packed into a single word, for ringfs_append_concurrent().
+ * Sectors and slots fit in 16 bits each, see _loc_packable().
+ */
+static uint32_t _loc_pack(const struct ringfs_loc *loc)
+{
+    return ((uint32_t) loc->sector << 16) | (uint32_t) loc->slot;
+}
+
+static struct ringfs_loc _loc_unpack(uint32_t packed)
+{
+    struct ringfs_loc loc = { packed >> 16, packed & 0xFFFF };
+    return loc;
+}
+
+static bool _loc_packable(struct ringfs *fs)
+{
+    return fs->flash->sector_count <= 0xFFFF && fs->slots_per_sector <= 0xFFFF;
+}
+
+/** Bring the concurrent append heads in line with the write head. */
+static void _write_publish(struct ringfs *fs)
+{
+    uint32_t packed = _loc_pack(&fs->write);
+    __atomic_store_n(&fs->write_next, packed, __ATOMIC_RELEASE);
+    __atomic_store_n(&fs->write_reserved, packed, __ATOMIC_RELEASE);
+    __atomic_store_n(&fs->write_committed, packed, __ATOMIC_RELEASE);
+    __atomic_store_n(&fs->write_failed, -1, __ATOMIC_RELEASE);
 }
 
-/**
- * @}
- * @defgroup loc
- * @{
- */
+/** Wait for a concurrent append head to get to the given position. */
+static void _write_wait(uint32_t *head, uint32_t packed)
+{
+    while (__atomic_load_n(head, __ATOMIC_ACQUIRE) != packed)
+        RINGFS_CONCURRENT_WAIT();
+}
+
+/** Distance of a location from the read head, in slots. */
+static int _loc_offset(struct ringfs *fs, const struct ringfs_loc *loc)
+{
+    int sector_diff = (loc->sector - fs->read.sector + fs->flash->sector_count) %
+        fs->flash->sector_count;
+
+    return sector_diff * fs->slots_per_sector + loc->slot - fs->read.slot;
+}
+
+/** Whether a location is between the read and write heads. */
+static bool _loc_in_ring(struct ringfs *fs, const struct ringfs_loc *loc)
+{
+    int offset = _loc_offset(fs, loc);
+    return offset >= 0 && offset <= _loc_offset(fs, &fs->write);
+}
+
+/**
+ * Sequence number of a location in the ring. The write head is never more
+ * than one sector past the sector last taken into use, so that sector is a
+ * good starting point.
+ */
+static uint32_t _loc_sequence(struct ringfs *fs, const struct ringfs_loc *loc)
+{
+    int count = fs->flash->sector_count;
+    int ahead = (fs->write.sector - fs->sequence_sector + count) % count;
+    struct ringfs_loc start = { fs->write.sector, 0 };
+
+    return fs->sequence + (uint32_t) (ahead * fs->slots_per_sector) +
+           (uint32_t) (_loc_offset(fs, loc) - _loc_offset(fs, &start));
+}
+
+/** Move cursors the read head went past up to it. */
+static void _cursors_follow(struct ringfs *fs)
+{
+    if (!_loc_in_ring(fs, &fs->cursor)) {
+        fs->cursor = fs->read;
+        fs->cursor_valid = 0;
+    }
+
+    for (struct ringfs_consumer *c = fs->consumers; c; c = c->next) {
+        if (!_loc_in_ring(fs, &c->cursor))
+            c->cursor = fs->read;
+        if (!_loc_in_ring(fs, &c->done))
+            c->done = fs->read;
+    }
+}
+
+/** Start all consumers over at the read head. */
+static void _consumers_reset(struct ringfs *fs)
+{
+    for (struct ringfs_consumer *c = fs->consumers; c; c = c->next) {
+        c->cursor = fs->read;
+        c->done = fs->read;
+    }
+}
+
+/** Find the consumer that has discarded the least, if there are any. */
+static struct ringfs_consumer *_consumer_slowest(struct ringfs *fs)
+{
+    struct ringfs_consumer *slowest = fs->consumers;
+
+    for (struct ringfs_consumer *c = fs->consumers; c; c = c->next)
+        if (_loc_offset(fs, &c->done) < _loc_offset(fs, &slowest->done))
+            slowest = c;
+
+    return slowest;
+}
+
+/**
+ * @}
+ * @defgroup record
+ * @{
+ */
+
+/**
+ * Header of a variable length record, see RINGFS_FEATURE_VARIABLE. Records are
+ * padded to whole words and never span sectors. In variable mode, slots count
+ * bytes and locations point at record headers.
+ */
+struct record_header {
+    uint32_t status;
+    uint32_t length;    /**< Payload length, with _check_encode(). */
+};
+
+static int _record_size(int length)
+{
+    return sizeof(struct record_header) + ((length + 3) & ~3);
+}
+
+/**
+ * Get the status, size and payload length of the record at loc. An ERASED
+ * header takes up the rest of the sector, and so does a torn one, or anything
+ * too close to the end of the sector: those read as GARBAGE.
+ */
+static int _record_get(struct ringfs *fs, struct ringfs_loc *loc, uint32_t *status, int *length)
+{
+    struct record_header header;
+    int rest = fs->slots_per_sector - loc->slot;
+
+    *status = SLOT_GARBAGE;
+    *length = 0;
+    if (rest < (int) sizeof(header))
+        return rest;
+
+    _flash_read(fs, fs->flash, _slot_address(fs, loc), &header, sizeof(header));
+    if (header.status == SLOT_ERASED && header.length == 0xFFFFFFFF) {
+        *status = SLOT_ERASED;
+        return rest;
+    }
+    if (header.status == SLOT_ERASED || _check_decode(header.length, length) != 0 ||
+            *length > fs->object_size || _record_size(*length) > rest) {
+        *length = 0;
+        return rest;
+    }
+
+    *status = header.status;
+    return _record_size(*length);
+}
+
+/** Advance a location past a record, to the next sector if no other one fits. */
+static void _loc_advance_record(struct ringfs *fs, struct ringfs_loc *loc, int size)
+{
+    loc->slot += size;
+    if (loc->slot + (int) sizeof(struct record_header) > fs->slots_per_sector)
+        _loc_advance_sector(fs, loc);
+}
+
+/** Advance the cursor past a record, counting valid objects it passes. */
+static void _cursor_advance_record(struct ringfs *fs, int size, bool valid)
+{
+    if (valid && fs->cursor_valid >= 0)
+        fs->cursor_valid++;
+    _loc_advance_record(fs, &fs->cursor, size);
+    if (fs->cursor.slot == 0)
+        fs->cursor_valid = 0;
+}
+
+/** Find the ERASED record header in a sector, or slots_per_sector if it's full. */
+static int _record_find_erased(struct ringfs *fs, int sector)
+{
+    struct ringfs_loc loc = { sector, 0 };
+
+    while (loc.sector == sector) {
+        uint32_t status;
+        int length;
+        int size = _record_get(fs, &loc, &status, &length);
+        if (status == SLOT_ERASED)
+            return loc.slot;
+        _loc_advance_record(fs, &loc, size);
+    }
+
+    return fs->slots_per_sector;
+}
+
+/** Mark the slot or record at loc as GARBAGE and step over it. */
+static void _slot_discard(struct ringfs *fs, struct ringfs_loc *loc)
+{
+    if (fs->features & RINGFS_FEATURE_VARIABLE) {
+        uint32_t status;
+        int length;
+        int size = _record_get(fs, loc, &status, &length);
+        if (status != SLOT_ERASED && status != SLOT_GARBAGE)
+            _slot_set_status(fs, loc, SLOT_GARBAGE);
+        _loc_advance_record(fs, loc, size);
+        return;
+    }
+
+    /* Program units can't take GARBAGE twice, so look first. */
+    uint32_t status = SLOT_VALID;
+    if (fs->program_unit)
+        _slot_get_status(fs, loc, &status);
+    if (status != SLOT_GARBAGE)
+        _slot_set_status(fs, loc, SLOT_GARBAGE);
+    _loc_advance_slot(fs, loc);
+}
+
+/** Count valid objects between the read and write heads in a single sector. */
+static int _sector_count_valid(struct ringfs *fs, int sector)
+{
+    struct ringfs_loc loc = { sector, 0 };
+    int end = fs->slots_per_sector;
+    int count = 0;
+
+    if (sector == fs->read.sector)
+        loc.slot = fs->read.slot;
+    if (sector == fs->write.sector)
+        end = fs->write.slot;
+
+    if (fs->features & RINGFS_FEATURE_VARIABLE) {
+        while (loc.slot < end) {
+            uint32_t status;
+            int length;
+            loc.slot += _record_get(fs, &loc, &status, &length);
+            if (status == SLOT_VALID)
+                count++;
+        }
+        return count;
+    }
+
+    for (; loc.slot < end; loc.slot++) {
+        uint32_t status;
+        _slot_get_status(fs, &loc, &status);
+        if (status == SLOT_VALID)
+            count++;
+    }
+
+    return count;
+}
+
+/**
+ * @}
+ * @defgroup checkpoint
+ * @{
+ */
+
+struct checkpoint_record {
+    uint32_t read_sector;
+    uint32_t write_sector;
+    uint32_t check;
+};
+
+static uint32_t _checkpoint_check(struct ringfs *fs, const struct checkpoint_record *record)
+{
+    return ~(record->read_sector ^ record->write_sector ^ fs->version);
+}
+
+static int _checkpoint_address(struct ringfs *fs, int index)
+{
+    return fs->checkpoint->sector_offset * fs->checkpoint->sector_size +
+           index * _unit_round(fs, sizeof(struct checkpoint_record));
+}
+
+static int _checkpoint_capacity(struct ringfs *fs)
+{
+    return fs->checkpoint->sector_size / _unit_round(fs, sizeof(struct checkpoint_record));
+}
+
+static bool _checkpoint_erased(struct ringfs *fs, int index)
+{
+    struct checkpoint_record record;
+    _flash_read(fs, fs->checkpoint, _checkpoint_address(fs, index), &record, sizeof(record));
+    return record.read_sector == 0xFFFFFFFF && record.write_sector == 0xFFFFFFFF &&
+           record.check == 0xFFFFFFFF;
+}
+
+/** Find the first unused record. Records are appended in order, so binary search. */
+static int _checkpoint_find_next(struct ringfs *fs)
+{
+    int lo = 0;
+    int hi = _checkpoint_capacity(fs);
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (_checkpoint_erased(fs, mid))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+/** Append a record if the read or write sector moved since the last one. */
+static void _checkpoint_update(struct ringfs *fs)
+{
+    if (!fs->checkpoint)
+        return;
+    if (fs->read.sector == fs->checkpoint_read && fs->write.sector == fs->checkpoint_write)
+        return;
+
+    if (fs->checkpoint_next < 0)
+        fs->checkpoint_next = _checkpoint_find_next(fs);
+    if (fs->checkpoint_next >= _checkpoint_capacity(fs)) {
+        _flash_sector_erase(fs, fs->checkpoint, _checkpoint_address(fs, 0));
+        fs->checkpoint_next = 0;
+    }
+
+    /* The record must not get ahead of the sector states it points at. */
+    _flash_sync(fs);
+    struct checkpoint_record record = { fs->read.sector, fs->write.sector, 0 };
+    record.check = _checkpoint_check(fs, &record);
+    _unit_program(fs, fs->checkpoint, _checkpoint_address(fs, fs->checkpoint_next),
+            &record, sizeof(record));
+
+    fs->checkpoint_next++;
+    fs->checkpoint_read = fs->read.sector;
+    fs->checkpoint_write = fs->write.sector;
+}
+
+/** Read a sector header during a checkpoint scan, rejecting foreign versions. */
+static int _checkpoint_sector_status(struct ringfs *fs, int sector, uint32_t *status)
+{
+    struct sector_header header;
+    _sector_get_header(fs, sector, &header);
+
+    if ((header.status == SECTOR_FREE || header.status == SECTOR_IN_USE) &&
+            header.version != fs->version)
+        return -1;
+    if (header.status != SECTOR_FREE && header.status != SECTOR_IN_USE &&
+            header.status != SECTOR_ERASING && header.status != SECTOR_ERASED)
+        return -1;
+
+    if (fs->sectors)
+        fs->sectors[sector].status = header.status;
+    *status = header.status;
+    return 0;
+}
+
+/**
+ * Find the read & write sectors using the last checkpoint record. The record
+ * is only a hint: it's checked against the sector headers around it and
+ * rejected if stale, in which case the caller falls back to a full scan.
+ *
+ * In-use sectors always form a single run, so a write sector that is IN_USE
+ * and followed by a sector that isn't must be the end of that run. The start
+ * of the run is found by walking back from the recorded read sector.
+ */
+static int _scan_checkpoint(struct ringfs *fs, int *read_sector, int *write_sector)
+{
+    int count = fs->flash->sector_count;
+    uint32_t status;
+
+    if (!fs->checkpoint)
+        return -1;
+
+    fs->checkpoint_read = -1;
+    fs->checkpoint_write = -1;
+    fs->checkpoint_next = _checkpoint_find_next(fs);
+    if (fs->checkpoint_next == 0)
+        return -1;
+
+    struct checkpoint_record record;
+    _flash_read(fs, fs->checkpoint, _checkpoint_address(fs, fs->checkpoint_next - 1),
+            &record, sizeof(record));
+    if (record.check != _checkpoint_check(fs, &record) ||
+            record.read_sector >= (uint32_t) count || record.write_sector >= (uint32_t) count)
+        return -1;
+
+    /* Sectors not looked at are loaded into the table on first use. */
+    if (fs->sectors) {
+        for (int sector=0; sector<count; sector++) {
+            fs->sectors[sector].status = SECTOR_UNKNOWN;
+            fs->sectors[sector].valid = -1;
+        }
+    }
+
+    /* The write sector must end the run of IN_USE sectors. If the write head
+     * had just moved to a FREE sector, the run ends right before it. */
+    int write = record.write_sector;
+    if (_checkpoint_sector_status(fs, write, &status) != 0)
+        return -1;
+    if (status == SECTOR_FREE) {
+        write = (write + count - 1) % count;
+        if (_checkpoint_sector_status(fs, write, &status) != 0)
+            return -1;
+    }
+    if (status != SECTOR_IN_USE)
+        return -1;
+    if (_checkpoint_sector_status(fs, (write + 1) % count, &status) != 0 ||
+            status == SECTOR_IN_USE)
+        return -1;
+
+    /* Walk back to the start of the run. Discards only move the read head
+     * forward, so the recorded read sector is never past it. */
+    int read = record.read_sector;
+    if (_checkpoint_sector_status(fs, read, &status) != 0)
+        return -1;
+    if (status != SECTOR_IN_USE)
+        read = write;
+    for (;;) {
+        int previous = (read + count - 1) % count;
+        if (previous == write)
+            break;
+        if (_checkpoint_sector_status(fs, previous, &status) != 0)
+            return -1;
+        if (status != SECTOR_IN_USE)
+            break;
+        read = previous;
+    }
+
+    fs->checkpoint_read = record.read_sector;
+    fs->checkpoint_write = record.write_sector;
+    *read_sector = read;
+    *write_sector = write;
+    return 0;
+}
+
+/**
+ * @}
+ * @defgroup coalesce
+ * @{
+ */
+
+static struct ringfs_coalesce *_coalesce(struct ringfs_flash_partition *flash)
+{
+    return (struct ringfs_coalesce *) flash;
+}
+
+static int _coalesce_sector_erase(struct ringfs_flash_partition *flash, int address)
+{
+    struct ringfs_coalesce *c = _coalesce(flash);
+
+    /*
+     * A pending program to the sector is usually its ERASING status, which
+     * has to be on the flash before the erase starts: a half-erased sector
+     * must not scan as the one it used to be.
+     */
+    if (ringfs_coalesce_flush(c) != 0)
+        return -1;
+    return c->lower->sector_erase(c->lower, address);
+}
+
+static int _coalesce_sector_erase_start(struct ringfs_flash_partition *flash, int address)
+{
+    struct ringfs_coalesce *c = _coalesce(flash);
+
+    if (ringfs_coalesce_flush(c) != 0)
+        return -1;
+    return c->lower->sector_erase_start(c->lower, address);
+}
+
+static int _coalesce_busy(struct ringfs_flash_partition *flash)
+{
+    struct ringfs_coalesce *c = _coalesce(flash);
+    return c->lower->busy(c->lower);
+}
+
+static ssize_t _coalesce_program(struct ringfs_flash_partition *flash, int address, const void *data, size_t size)
+{
+    struct ringfs_coalesce *c = _coalesce(flash);
+    const uint8_t *bytes = data;
+    size_t done = 0;
+
+    /* Programs spanning pages gain nothing from the buffer, and go straight
+     * through as without the layer. */
+    if (size > 0 && address / c->page_size != (address + (int) size - 1) / c->page_size) {
+        if (c->page_address >= 0 && c->page_address + c->page_size > address &&
+                c->page_address < address + (int) size && ringfs_coalesce_flush(c) != 0)
+            return -1;
+        return c->lower->program(c->lower, address, data, size);
+    }
+
+    while (done < size) {
+        int page_address = (address + done) - (address + done) % c->page_size;
+        int offset = (address + done) - page_address;
+        int chunk = c->page_size - offset;
+        if ((size_t) chunk > size - done)
+            chunk = size - done;
+
+        if (c->page_address != page_address) {
+            if (ringfs_coalesce_flush(c) != 0)
+                return -1;
+            memset(c->page, 0xFF, c->page_size);
+            c->page_address = page_address;
+            c->dirty_start = c->page_size;
+            c->dirty_end = 0;
+        }
+
+        /* Programming only clears bits, so pending programs combine. */
+        for (int i=0; i<chunk; i++)
+            c->page[offset + i] &= bytes[done + i];
+        if (offset < c->dirty_start)
+            c->dirty_start = offset;
+        if (offset + chunk > c->dirty_end)
+            c->dirty_end = offset + chunk;
+
+        done += chunk;
+    }
+
+    return size;
+}
+
+static ssize_t _coalesce_read(struct ringfs_flash_partition *flash, int address, void *data, size_t size)
+{
+    struct ringfs_coalesce *c = _coalesce(flash);
+
+    ssize_t ret = c->lower->read(c->lower, address, data, size);
+    if (ret < 0 || c->page_address < 0)
+        return ret;
+
+    /* Apply pending programs to what's read. */
+    int start = c->page_address + c->dirty_start;
+    int end = c->page_address + c->dirty_end;
+    if (start < address)
+        start = address;
+    if (end > address + (int) size)
+        end = address + size;
+    for (int i=start; i<end; i++)
+        ((uint8_t *) data)[i - address] &= c->page[i - c->page_address];
+
+    return ret;
+}
+
+static const void *_coalesce_map(struct ringfs_flash_partition *flash, int address, size_t size)
+{
+    struct ringfs_coalesce *c = _coalesce(flash);
+
+    if (ringfs_coalesce_flush(c) != 0)
+        return NULL;
+    return c->lower->map(c->lower, address, size);
+}
+
+static int _coalesce_sync(struct ringfs_flash_partition *flash)
+{
+    return ringfs_coalesce_flush(_coalesce(flash));
+}
+
+/**
+ * @}
+ * @defgroup stripe
+ * @{
+ */
+
+static struct ringfs_stripe *_stripe(struct ringfs_flash_partition *flash)
+{
+    return (struct ringfs_stripe *) flash;
+}
+
+/** Find the device an address falls on, and the address within it. */
+static int _stripe_locate(struct ringfs_stripe *s, int address, int *device_address)
+{
+    int sector_size = s->flash.sector_size;
+    int sector = address / sector_size;
+    int device = sector % s->device_count;
+
+    *device_address = (s->devices[device]->sector_offset + sector / s->device_count) * sector_size +
+                      address % sector_size;
+    return device;
+}
+
+/** Bytes from an address to the end of its sector, at most size. */
+static size_t _stripe_chunk(struct ringfs_stripe *s, int address, size_t size)
+{
+    size_t left = s->flash.sector_size - address % s->flash.sector_size;
+    return left < size ? left : size;
+}
+
+static int _stripe_sector_erase(struct ringfs_flash_partition *flash, int address)
+{
+    struct ringfs_stripe *s = _stripe(flash);
+    int device_address;
+    struct ringfs_flash_partition *device = s->devices[_stripe_locate(s, address, &device_address)];
+
+    return device->sector_erase(device, device_address);
+}
+
+static int _stripe_busy(struct ringfs_flash_partition *flash)
+{
+    struct ringfs_stripe *s = _stripe(flash);
+
+    if (s->erasing < 0)
+        return 0;
+    struct ringfs_flash_partition *device = s->devices[s->erasing];
+    int busy = device->busy(device);
+    if (busy <= 0)
+        s->erasing = -1;
+    return busy;
+}
+
+static int _stripe_sector_erase_start(struct ringfs_flash_partition *flash, int address)
+{
+    struct ringfs_stripe *s = _stripe(flash);
+    int device_address;
+    int index = _stripe_locate(s, address, &device_address);
+    struct ringfs_flash_partition *device = s->devices[index];
+
+    /* busy can only speak for one erase at a time. */
+    while (_stripe_busy(flash) > 0);
+
+    if (device->sector_erase_start(device, device_address) != 0)
+        return -1;
+    s->erasing = index;
+    return 0;
+}
+
+static ssize_t _stripe_program(struct ringfs_flash_partition *flash, int address, const void *data, size_t size)
+{
+    struct ringfs_stripe *s = _stripe(flash);
+    const uint8_t *bytes = data;
+    size_t done = 0;
+
+    while (done < size) {
+        int device_address;
+        struct ringfs_flash_partition *device = s->devices[_stripe_locate(s, address + done, &device_address)];
+        size_t chunk = _stripe_chunk(s, address + done, size - done);
+        if (device->program(device, device_address, bytes + done, chunk) != (ssize_t) chunk)
+            return -1;
+        done += chunk;
+    }
+
+    return size;
+}
+
+static ssize_t _stripe_read(struct ringfs_flash_partition *flash, int address, void *data, size_t size)
+{
+    struct ringfs_stripe *s = _stripe(flash);
+    uint8_t *bytes = data;
+    size_t done = 0;
+
+    while (done < size) {
+        int device_address;
+        struct ringfs_flash_partition *device = s->devices[_stripe_locate(s, address + done, &device_address)];
+        size_t chunk = _stripe_chunk(s, address + done, size - done);
+        if (device->read(device, device_address, bytes + done, chunk) != (ssize_t) chunk)
+            return -1;
+        done += chunk;
+    }
+
+    return size;
+}
+
+static const void *_stripe_map(struct ringfs_flash_partition *flash, int address, size_t size)
+{
+    struct ringfs_stripe *s = _stripe(flash);
+    int device_address;
+    struct ringfs_flash_partition *device = s->devices[_stripe_locate(s, address, &device_address)];
+
+    /* Neighbouring sectors aren't contiguous in memory. */
+    if (_stripe_chunk(s, address, size) != size)
+        return NULL;
+    return device->map(device, device_address, size);
+}
+
+static int _stripe_sync(struct ringfs_flash_partition *flash)
+{
+    struct ringfs_stripe *s = _stripe(flash);
+    int result = 0;
+
+    for (int i=0; i<s->device_count; i++) {
+        struct ringfs_flash_partition *device = s->devices[i];
+        if (device->sync && device->sync(device) != 0)
+            result = -1;
+    }
+    return result;
+}
+
+/**
+ * @}
+ */
+
+/* And here we go. */
+
+/** Calculate values that depend on the on-flash layout. */
+static void _layout(struct ringfs *fs)
+{
+    fs->sector_header_size = _unit_round(fs, _sector_field_offset(fs, 0));
+    fs->slot_header_size = _status_size(fs, 3);
+    fs->slot_size = fs->slot_header_size + _unit_round(fs, fs->object_size);
+    if (fs->features & RINGFS_FEATURE_VARIABLE)
+        fs->slots_per_sector = fs->flash->sector_size - fs->sector_header_size;
+    else
+        fs->slots_per_sector = (fs->flash->sector_size - fs->sector_header_size) / fs->slot_size;
+}
+
+int ringfs_init(struct ringfs *fs, struct ringfs_flash_partition *flash, uint32_t version, int object_size)
+{
+    /* Copy arguments to instance. */
+    fs->flash = flash;
+    fs->version = version;
+    fs->object_size = object_size;
+    fs->features = 0;
+    fs->program_unit = 0;
+    fs->read_marks = 0;
+    fs->sequence_sector = 0;
+    fs->sequence = 0;
+    fs->key = NULL;
+    fs->key_sector = -1;
+    fs->sectors = NULL;
+    fs->cache = NULL;
+    fs->cache_windows = 0;
+    fs->cursor_valid = 0;
+    fs->cursor_used = 0;
+    fs->checkpoint = NULL;
+    fs->consumers = NULL;
+    fs->background_erase = 0;
+    fs->erasing = -1;
+    fs->erasing_count = 0;
+    fs->reserve = 1;
+#ifdef RINGFS_STATS
+    ringfs_stats_reset(fs);
+#endif
+
+    /* Precalculate commonly used values. */
+    _layout(fs);
+
+    return 0;
+}
+
+int ringfs_set_features(struct ringfs *fs, uint32_t features)
+{
+    uint32_t known = RINGFS_FEATURE_DISCARD_MARKS | RINGFS_FEATURE_VARIABLE |
+                     RINGFS_FEATURE_SEQUENCE | RINGFS_FEATURE_KEY_RANGE |
+                     RINGFS_FEATURE_ERASE_COUNT;
+    if (features & ~known)
+        return -1;
+    /* Sequence numbers are counted in slots. */
+    if ((features & RINGFS_FEATURE_VARIABLE) && (features & RINGFS_FEATURE_SEQUENCE))
+        return -1;
+    /* Record headers pack the length next to the status. */
+    if ((features & RINGFS_FEATURE_VARIABLE) && fs->program_unit)
+        return -1;
+
+    fs->features = features;
+    _layout(fs);
+
+    /* Both record lengths and discard marks are 16 bits wide. */
+    if (((features & RINGFS_FEATURE_VARIABLE) &&
+                (fs->object_size > 0xFFFF || _record_size(fs->object_size) > fs->slots_per_sector)) ||
+            ((features & RINGFS_FEATURE_DISCARD_MARKS) && fs->slots_per_sector > 0xFFFF)) {
+        fs->features = 0;
+        _layout(fs);
+        return -1;
+    }
+
+    return 0;
+}
+
+int ringfs_set_program_unit(struct ringfs *fs, int unit)
+{
+    if (unit != 0 && (unit < 8 || unit > RINGFS_MAX_PROGRAM_UNIT || (unit & (unit - 1)) != 0 ||
+                fs->flash->sector_size % unit != 0))
+        return -1;
+    if (unit != 0 && (fs->features & RINGFS_FEATURE_VARIABLE))
+        return -1;
+
+    fs->program_unit = unit;
+    _layout(fs);
+    return 0;
+}
+
+int ringfs_set_background_erase(struct ringfs *fs, int enable)
+{
+    fs->background_erase = enable;
+    return 0;
+}
+
+int ringfs_set_reserve(struct ringfs *fs, int sectors)
+{
+    /* At least one sector has to be left for data. */
+    if (sectors < 1 || sectors > fs->flash->sector_count - 1)
+        return -1;
+
+    fs->reserve = sectors;
+    return 0;
+}
+
+int ringfs_set_key(struct ringfs *fs, uint32_t (*key)(const void *object, int size))
+{
+    fs->key = key;
+    return 0;
+}
+
+int ringfs_set_sector_table(struct ringfs *fs, struct ringfs_sector_info *table)
+{
+    fs->sectors = table;
+    return 0;
+}
+
+int ringfs_set_read_cache(struct ringfs *fs, void *buffer, int size, int window)
+{
+    if (buffer && (window <= 0 || size < window || fs->flash->sector_size % window != 0))
+        return -1;
+
+    fs->cache = buffer;
+    fs->cache_window = window;
+    fs->cache_windows = buffer ? size / window : 0;
+    if (fs->cache_windows > RINGFS_CACHE_WINDOWS)
+        fs->cache_windows = RINGFS_CACHE_WINDOWS;
+    fs->cache_next = 0;
+    for (int i=0; i<fs->cache_windows; i++)
+        fs->cache_address[i] = -1;
+    return 0;
+}
+
+int ringfs_set_checkpoint(struct ringfs *fs, struct ringfs_flash_partition *region)
+{
+    fs->checkpoint = region;
+    fs->checkpoint_next = -1;
+    fs->checkpoint_read = -1;
+    fs->checkpoint_write = -1;
+    return 0;
+}
+
+int ringfs_format(struct ringfs *fs)
+{
+    STATS_CALL(fs, RINGFS_CALL_FORMAT);
+
+    /* Let a background erase finish before programming its sector; the
+     * sector gets erased again below. */
+    if (fs->erasing >= 0) {
+        while (fs->flash->busy(fs->flash) > 0);
+        _cache_invalidate(fs, _sector_address(fs, fs->erasing), fs->flash->sector_size);
+        fs->erasing = -1;
+    }
+
+    /* Mark all sectors to prevent half-erased filesystems. */
+    for (int sector=0; sector<fs->flash->sector_count; sector++)
+        _sector_set_status(fs, sector, SECTOR_FORMATTING);
+
+    /* Erase, update version, mark as free. */
+    for (int sector=0; sector<fs->flash->sector_count; sector++)
+        _sector_free(fs, sector);
+
+    /* Start reading & writing at the first sector. */
+    fs->read.sector = 0;
+    fs->read.slot = 0;
+    fs->write.sector = 0;
+    fs->write.slot = 0;
+    fs->cursor.sector = 0;
+    fs->cursor.slot = 0;
+    fs->cursor_valid = 0;
+    fs->cursor_used = 0;
+    fs->read_marks = 0;
+    fs->sequence_sector = 0;
+    fs->sequence = 0;
+    fs->key_sector = -1;
+    _write_publish(fs);
+    _consumers_reset(fs);
+
+    /* Start the checkpoint log afresh. */
+    if (fs->checkpoint) {
+        _flash_sector_erase(fs, fs->checkpoint, _checkpoint_address(fs, 0));
+        fs->checkpoint_next = 0;
+        fs->checkpoint_read = -1;
+        fs->checkpoint_write = -1;
+        _checkpoint_update(fs);
+    }
+
+    return 0;
+}
+
+/**
+ * Find the read & write sectors by looking at every sector header, fixing
+ * partially erased sectors on the way.
+ */
+static int _scan_sectors(struct ringfs *fs, int *read_sector, int *write_sector)
+{
+    bool previous_used = false;
+    /* The read sector is the first IN_USE sector *after* one that isn't
+     * (or the first one). */
+    int read = 0;
+    /* The write sector is the last IN_USE sector *before* one that isn't
+     * (or the last one). */
+    int write = fs->flash->sector_count - 1;
+    /* There must be at least one sector not in use at all times. */
+    bool unused_seen = false;
+    /* If there's no IN_USE sector, we start at the first FREE one. */
+    bool used_seen = false;
+    int first_free = -1;
+
+    /* Iterate over sectors. */
+    for (int sector=0; sector<fs->flash->sector_count; sector++) {
+        /* Read sector header. */
+        struct sector_header header;
+        _sector_get_header(fs, sector, &header);
+
+        /* Detect partially-formatted partitions. */
+        if (header.status == SECTOR_FORMATTING) {
+            printf("ringfs_scan: partially formatted partition\r\n");
+            return -1;
+        }
+
+        /* Detect corrupted sectors. Sectors that are waiting to be erased, or
+         * were only partially erased, are fine: they're never read, and get
+         * erased once the write head needs them. */
+        if (header.status != SECTOR_FREE && header.status != SECTOR_IN_USE &&
+                header.status != SECTOR_ERASING && header.status != SECTOR_ERASED) {
+            printf("ringfs_scan: corrupted sector %d\r\n", sector);
+            return -1;
+        }
+
+        /* Detect obsolete versions. Erasing sectors are skipped because the
+         * version could have been invalid due to a partial erase. */
+        if ((header.status == SECTOR_FREE || header.status == SECTOR_IN_USE) &&
+                header.version != fs->version) {
+            printf("ringfs_scan: incompatible version 0x%08"PRIx32"\r\n", header.version);
+            return -1;
+        }
+
+        /* Remember the state to spare header reads later on. */
+        if (fs->sectors) {
+            fs->sectors[sector].status = header.status;
+            fs->sectors[sector].valid = (header.status == SECTOR_IN_USE) ? -1 : 0;
+        }
+
+        bool used = (header.status == SECTOR_IN_USE);
+
+        /* Record the presence of IN_USE and other sectors. */
+        if (used)
+            used_seen = true;
+        else
+            unused_seen = true;
+        if (header.status == SECTOR_FREE && first_free < 0)
+            first_free = sector;
+
+        /* Update read & write sectors according to the above rules. */
+        if (used && !previous_used)
+            read = sector;
+        if (!used && previous_used)
+            write = sector-1;
+
+        previous_used = used;
+    }
+
+    /* Detect the lack of a sector to write to next. */
+    if (!unused_seen) {
+        printf("ringfs_scan: invariant violated: no free sector found\r\n");
+        return -1;
+    }
+
+    /* Start writing at the first FREE sector if the filesystem is empty. */
+    if (!used_seen) {
+        write = first_free >= 0 ? first_free : 0;
+        read = write;
+    }
+
+    *read_sector = read;
+    *write_sector = write;
+    return 0;
+}
+
+
+int ringfs_scan(struct ringfs *fs)
+{
+    STATS_CALL(fs, RINGFS_CALL_SCAN);
+
+    int read_sector;
+    int write_sector;
+
+    /* Don't look at a sector that's still being erased. */
+    if (fs->erasing >= 0)
+        _sector_free(fs, fs->erasing);
+
+    /* Anything cached may have changed before mounting. */
+    _cache_invalidate(fs, _sector_address(fs, 0), fs->flash->sector_count * fs->flash->sector_size);
+
+    /* Try the cheap way first, fall back to reading every sector header. */
+    if (_scan_checkpoint(fs, &read_sector, &write_sector) != 0 &&
+            _scan_sectors(fs, &read_sector, &write_sector) != 0)
+        return -1;
+
+    /* Sequence numbers carry on from the last sector taken into use. The ring
+     * is only ever left without one right after ringfs_format(). */
+    fs->sequence_sector = write_sector;
+    fs->sequence = 0;
+    if (fs->features & RINGFS_FEATURE_SEQUENCE) {
+        uint32_t status;
+        _sector_get_status(fs, write_sector, &status);
+        if (status == SECTOR_IN_USE && _sector_get_sequence(fs, write_sector, &fs->sequence) != 0) {
+            printf("ringfs_scan: corrupted sequence number in sector %d\r\n", write_sector);
+            return -1;
+        }
+    }
+
+    /* Keys appended to the write sector before the scan aren't known. */
+    fs->key_sector = -1;
+
+    /* Find the write head. Slots are written in order, so the ERASED slots
+     * form a suffix of the write sector and the boundary can be binary searched. */
+    fs->write.sector = write_sector;
+    if (fs->features & RINGFS_FEATURE_VARIABLE)
+        fs->write.slot = _record_find_erased(fs, write_sector);
+    else
+        fs->write.slot = _slot_find_erased(fs, write_sector);
+    if (fs->write.slot >= fs->slots_per_sector)
+        _loc_advance_sector(fs, &fs->write);
+    /* If the sector was full, we're at the beginning of a FREE sector now. */
+
+    /* Position the read head at the start of the first IN_USE sector, then skip
+     * over garbage/invalid slots until something of value is found or we reach
+     * the write head which means there's no data. */
+    fs->read.sector = read_sector;
+    fs->read.slot = 0;
+    fs->read_marks = 0;
+    if (fs->features & RINGFS_FEATURE_DISCARD_MARKS) {
+        /* Discard marks tell where to start right away. */
+        fs->read.slot = _sector_get_mark(fs, read_sector, &fs->read_marks);
+        if (fs->read.sector == fs->write.sector && fs->read.slot > fs->write.slot)
+            fs->read.slot = fs->write.slot;
+        if (fs->read.slot >= fs->slots_per_sector) {
+            _loc_advance_sector(fs, &fs->read);
+            fs->read_marks = 0;
+        }
+    }
+    if (fs->features & RINGFS_FEATURE_VARIABLE) {
+        /* Records can only be walked one at a time. Stop at an ERASED header
+         * too: it's where the read head was left when a record got pushed
+         * into the next sector. */
+        while (!_loc_equal(&fs->read, &fs->write)) {
+            uint32_t status;
+            int length;
+            int size = _record_get(fs, &fs->read, &status, &length);
+            if (status == SLOT_VALID || status == SLOT_ERASED)
+                break;
+            _loc_advance_record(fs, &fs->read, size);
+        }
+    } else {
+        while (!_loc_equal(&fs->read, &fs->write)) {
+            int end = fs->slots_per_sector;
+            if (fs->read.sector == fs->write.sector)
+                end = fs->write.slot;
+
+            /* Jump over runs of discarded slots. */
+            _slot_skip_garbage(fs, &fs->read, end);
+            if (fs->read.slot >= fs->slots_per_sector) {
+                _loc_advance_sector(fs, &fs->read);
+                continue;
+            }
+            if (_loc_equal(&fs->read, &fs->write))
+                break;
+
+            uint32_t status;
+            _slot_get_status(fs, &fs->read, &status);
+            if (status == SLOT_VALID)
+                break;
+
+            _loc_advance_slot(fs, &fs->read);
+        }
+    }
+
+    /* Move the read cursor to the read head position. */
+    fs->cursor = fs->read;
+    fs->cursor_valid = 0;
+    fs->cursor_used = 0;
+    _write_publish(fs);
+    _consumers_reset(fs);
+
+    _checkpoint_update(fs);
+
+    return 0;
+}
+
+int ringfs_capacity(struct ringfs *fs)
+{
+    return fs->slots_per_sector * (fs->flash->sector_count - fs->reserve);
+}
+
+int ringfs_count_estimate(struct ringfs *fs)
+{
+    return _loc_offset(fs, &fs->write);
+}
+
+int ringfs_count_exact(struct ringfs *fs)
+{
+    STATS_CALL(fs, RINGFS_CALL_COUNT_EXACT);
+
+    int count = 0;
+
+    /* With a sector table, only sectors not counted yet need a walk. Records
+     * are always walked sector by sector. */
+    if (fs->sectors || (fs->features & RINGFS_FEATURE_VARIABLE)) {
+        int sector = fs->read.sector;
+        for (;;) {
+            int valid = fs->sectors ? fs->sectors[sector].valid : -1;
+            if (valid < 0)
+                valid = _sector_count_valid(fs, sector);
+            if (fs->sectors)
+                fs->sectors[sector].valid = valid;
+            count += valid;
+            if (sector == fs->write.sector)
+                break;
+            sector = (sector + 1) % fs->flash->sector_count;
+        }
+        return count;
+    }
+
+    /* Use a temporary loc for iteration. */
+    struct ringfs_loc loc = fs->read;
+    while (!_loc_equal(&loc, &fs->write)) {
+        uint32_t status;
+        _slot_get_status(fs, &loc, &status);
+        
+        if (status == SLOT_VALID)
+            count++;
+
+        _loc_advance_slot(fs, &loc);
+    }
+
+    return count;
+}
+
+/**
+ * Mark the FREE write sector as used, numbering its slots first. The sector
+ * written before is complete now, so its key range is stored.
+ */
+static void _write_sector_use(struct ringfs *fs)
+{
+    if (fs->features & RINGFS_FEATURE_KEY_RANGE) {
+        /* Unless it's been freed to make room in the meantime. */
+        uint32_t status = SECTOR_FREE;
+        if (fs->key_sector >= 0)
+            _sector_get_status(fs, fs->key_sector, &status);
+        if (status == SECTOR_IN_USE)
+            _sector_set_range(fs, fs->key_sector, fs->key_min, fs->key_max);
+        /* Empty so far: no key is in range. */
+        fs->key_sector = fs->write.sector;
+        fs->key_min = 0xFFFFFFFF;
+        fs->key_max = 0;
+    }
+
+    if (fs->features & RINGFS_FEATURE_SEQUENCE) {
+        struct ringfs_loc start = { fs->write.sector, 0 };
+        fs->sequence = _loc_sequence(fs, &start);
+        fs->sequence_sector = fs->write.sector;
+        _sector_set_sequence(fs, fs->write.sector, fs->sequence);
+    }
+
+    _sector_set_status(fs, fs->write.sector, SECTOR_IN_USE);
+}
+
+/**
+ * Make sure the write sector is writable, freeing the next sector if needed.
+ * Shared by all the append paths.
+ */
+static int _append_prepare(struct ringfs *fs)
+{
+    uint32_t status;
+
+    /*
+     * There are three sectors involved in appending a value:
+     * - the sector where the append happens: it has to be writable
+     * - the next sector: it must be free (invariant)
+     * - the next-next sector: read & cursor heads are moved there if needed
+     * With a larger reserve, the next few sectors are kept free as well. They
+     * only need checking when the write head enters a new sector.
+     */
+    int reserve = fs->write.slot == 0 ? fs->reserve : 1;
+
+    /* Make sure the next sectors are free. */
+    for (int i=1; i<=reserve; i++) {
+        int next_sector = (fs->write.sector+i) % fs->flash->sector_count;
+        _sector_get_status(fs, next_sector, &status);
+        if (status == SECTOR_FREE)
+            continue;
+
+        /* Next sector must be freed. But first... */
+
+        /* Move the read & cursor heads out of the way. */
+        if (fs->read.sector == next_sector) {
+            _loc_advance_sector(fs, &fs->read);
+            fs->read_marks = 0;
+        }
+        if (fs->cursor.sector == next_sector) {
+            _loc_advance_sector(fs, &fs->cursor);
+            fs->cursor_valid = 0;
+        }
+        _cursors_follow(fs);
+
+        /* Free the next sector, or have ringfs_poll() do it later. It only
+         * has to be FREE by the time the write head gets there. */
+        if (!fs->background_erase)
+            _sector_free(fs, next_sector);
+        else if (status != SECTOR_ERASING)
+            _sector_set_status(fs, next_sector, SECTOR_ERASING);
+    }
+
+    /* Now we can make sure the current write sector is writable. Sectors still
+     * waiting to be erased can only show up here on an empty filesystem. */
+    _sector_get_status(fs, fs->write.sector, &status);
+    if (status == SECTOR_ERASING || status == SECTOR_ERASED) {
+        _sector_free(fs, fs->write.sector);
+        status = SECTOR_FREE;
+    }
+    if (status == SECTOR_FREE) {
+        /* Free sector. Mark as used. */
+        _write_sector_use(fs);
+    } else if (status != SECTOR_IN_USE) {
+        printf("ringfs_append: corrupted filesystem\r\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int ringfs_poll(struct ringfs *fs)
+{
+    STATS_CALL(fs, RINGFS_CALL_POLL);
+
+    /* Finish the erase in progress first. */
+    if (fs->erasing >= 0) {
+        if (fs->flash->busy(fs->flash) > 0)
+            return 1;
+        int sector = fs->erasing;
+        _cache_invalidate(fs, _sector_address(fs, sector), fs->flash->sector_size);
+        fs->erasing = -1;
+        _sector_free_finish(fs, sector, fs->erasing_count);
+    }
+
+    /* Look for sectors waiting to be erased, in the order the write head will
+     * need them: from the write sector up to the read side of the ring. */
+    for (int i=0; i<fs->flash->sector_count; i++) {
+        int sector = (fs->write.sector + i) % fs->flash->sector_count;
+        uint32_t status;
+        _sector_get_status(fs, sector, &status);
+
+        if (status == SECTOR_ERASING || status == SECTOR_ERASED) {
+            if (!fs->flash->sector_erase_start) {
+                _sector_free(fs, sector);
+                return 1;
+            }
+            fs->erasing_count = _sector_next_erase_count(fs, sector);
+            _sector_set_status(fs, sector, SECTOR_ERASING);
+            if (_flash_sector_erase_start(fs, fs->flash, _sector_address(fs, sector)) != 0)
+                return -1;
+            fs->erasing = sector;
+            return 1;
+        }
+        if (i > 0 && status == SECTOR_IN_USE)
+            break;
+    }
+
+    return 0;
+}
+
+int ringfs_append(struct ringfs *fs, const void *object)
+{
+    STATS_CALL(fs, RINGFS_CALL_APPEND);
+
+    if (fs->features & RINGFS_FEATURE_VARIABLE)
+        return -1;
+
+    if (_append_prepare(fs) != 0)
+        return -1;
+
+    /* Preallocate slot. */
+    _slot_set_status(fs, &fs->write, SLOT_RESERVED);
+
+    /* Write object. */
+    _unit_program(fs, fs->flash,
+            _slot_address(fs, &fs->write) + fs->slot_header_size,
+            object, fs->object_size);
+
+    /* Commit write. */
+    _slot_set_status(fs, &fs->write, SLOT_VALID);
+    _sector_add_valid(fs, fs->write.sector, 1);
+    _sector_add_key(fs, object, fs->object_size);
+
+    /* Advance the write head. */
+    _loc_advance_slot(fs, &fs->write);
+    _write_publish(fs);
+
+    _checkpoint_update(fs);
+
+    return 0;
+}
+
+int ringfs_append_concurrent(struct ringfs *fs, const void *object)
+{
+    STATS_CALL(fs, RINGFS_CALL_APPEND);
+
+    if ((fs->features & RINGFS_FEATURE_VARIABLE) || !_loc_packable(fs))
+        return -1;
+
+    /* Take the next slot. */
+    uint32_t packed = __atomic_load_n(&fs->write_next, __ATOMIC_RELAXED);
+    uint32_t next;
+    struct ringfs_loc loc;
+    do {
+        loc = _loc_unpack(packed);
+        struct ringfs_loc after = loc;
+        _loc_advance_slot(fs, &after);
+        next = _loc_pack(&after);
+    } while (!__atomic_compare_exchange_n(&fs->write_next, &packed, next,
+                true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    /* The first slot of a sector comes with preparing the sector. That's done
+     * once everything before has been committed, and before anyone reserves
+     * a slot after it, so nothing else touches the flash meanwhile. A sector
+     * left unprepared is skipped, and the outcome is published before the
+     * next slot gets reserved. */
+    if (loc.slot == 0) {
+        _write_wait(&fs->write_committed, packed);
+        fs->write = loc;
+        int failed = _append_prepare(fs) != 0 ? loc.sector : -1;
+        __atomic_store_n(&fs->write_failed, failed, __ATOMIC_RELEASE);
+    }
+
+    /* Reserve slots in order: the first ERASED slot has to mark the write
+     * head no matter where power is lost. */
+    _write_wait(&fs->write_reserved, packed);
+    int result = __atomic_load_n(&fs->write_failed, __ATOMIC_ACQUIRE) == loc.sector ? -1 : 0;
+    if (result == 0)
+        _slot_set_status(fs, &loc, SLOT_RESERVED);
+    __atomic_store_n(&fs->write_reserved, next, __ATOMIC_RELEASE);
+
+    /* Write object, alongside other producers. */
+    if (result == 0)
+        _unit_program(fs, fs->flash,
+                _slot_address(fs, &loc) + fs->slot_header_size,
+                object, fs->object_size);
+
+    /* Commit in order too, so VALID objects never follow an uncommitted one. */
+    _write_wait(&fs->write_committed, packed);
+    if (result == 0) {
+        _slot_set_status(fs, &loc, SLOT_VALID);
+        _sector_add_valid(fs, loc.sector, 1);
+        _sector_add_key(fs, object, fs->object_size);
+        _loc_advance_slot(fs, &loc);
+        fs->write = loc;
+        _checkpoint_update(fs);
+    }
+    __atomic_store_n(&fs->write_committed, next, __ATOMIC_RELEASE);
+
+    return result;
+}
+
+int ringfs_append_var(struct ringfs *fs, const void *object, int size)
+{
+    STATS_CALL(fs, RINGFS_CALL_APPEND);
+
+    if (!(fs->features & RINGFS_FEATURE_VARIABLE) || size < 0 || size > fs->object_size)
+        return -1;
+
+    /* Records don't span sectors. Leave the rest of this one erased. */
+    int record = _record_size(size);
+    if (fs->write.slot + record > fs->slots_per_sector)
+        _loc_advance_sector(fs, &fs->write);
+
+    if (_append_prepare(fs) != 0)
+        return -1;
+
+    /* Preallocate the record along with its length. A torn header makes the
+     * rest of the sector unusable, which ringfs_scan() copes with. */
+    struct record_header header = { SLOT_RESERVED, _check_encode(size) };
+    _flash_program(fs, fs->flash, _slot_address(fs, &fs->write), &header, sizeof(header));
+    _flash_sync(fs);
+
+    /* Write object. */
+    _flash_program(fs, fs->flash,
+            _slot_address(fs, &fs->write) + sizeof(struct record_header),
+            object, size);
+
+    /* Commit write. */
+    _slot_set_status(fs, &fs->write, SLOT_VALID);
+    _sector_add_valid(fs, fs->write.sector, 1);
+    _sector_add_key(fs, object, size);
+
+    /* Advance the write head. */
+    _loc_advance_record(fs, &fs->write, record);
+    _write_publish(fs);
+
+    _checkpoint_update(fs);
+
+    return 0;
+}
+
+/**
+ * Program a run of consecutive slots in one go, with every slot header set to
+ * the given status. The buffer must hold at least count slots.
+ */
+static int _slots_program(struct ringfs *fs, struct ringfs_loc *loc, const uint8_t *objects,
+        int count, uint32_t status, uint8_t *buffer)
+{
+    int slot_size = sizeof(struct slot_header) + fs->object_size;
+
+    for (int i=0; i<count; i++) {
+        uint8_t *slot = buffer + i * slot_size;
+        memcpy(slot + offsetof(struct slot_header, status), &status, sizeof(status));
+        memcpy(slot + sizeof(struct slot_header), objects + i * fs->object_size, fs->object_size);
+    }
+
+    return _flash_program(fs, fs->flash, _slot_address(fs, loc), buffer, count * slot_size);
+}
+
+int ringfs_append_batch(struct ringfs *fs, const void *objects, int count)
+{
+    const uint8_t *object = objects;
+    int slot_size = sizeof(struct slot_header) + fs->object_size;
+    /* Merged programs reprogram slot headers, which program units don't allow. */
+    int slots_per_program = fs->program_unit ? 0 : RINGFS_BATCH_BUFFER_SIZE / slot_size;
+    uint8_t buffer[RINGFS_BATCH_BUFFER_SIZE];
+
+    STATS_CALL(fs, RINGFS_CALL_APPEND);
+
+    if (count < 0 || (fs->features & RINGFS_FEATURE_VARIABLE))
+        return -1;
+
+    while (count > 0) {
+        /* Sector state only needs checking once per sector crossed. */
+        if (_append_prepare(fs) != 0)
+            return -1;
+
+        /* Fill the rest of the write sector, one chunk at a time. */
+        int run = fs->slots_per_sector - fs->write.slot;
+        if (run > count)
+            run = count;
+
+        while (run > 0) {
+            int chunk = slots_per_program > 0 ? slots_per_program : 1;
+            if (chunk > run)
+                chunk = run;
+
+            if (slots_per_program > 0) {
+                /* Reserve and write all objects with one program, then commit
+                 * them with another. NOR flash programs in address order, so a
+                 * program cut by power loss leaves a prefix of RESERVED slots
+                 * and the first ERASED one still marks the write head.
+                 * Reprogramming headers and payloads with identical values
+                 * leaves NOR cells untouched. */
+                _slots_program(fs, &fs->write, object, chunk, SLOT_RESERVED, buffer);
+                _flash_sync(fs);
+                _slots_program(fs, &fs->write, object, chunk, SLOT_VALID, buffer);
+            } else {
+                /* Slot doesn't fit the buffer, or can't be programmed twice;
+                 * fall back to separate programs. */
+                _slot_set_status(fs, &fs->write, SLOT_RESERVED);
+                _unit_program(fs, fs->flash,
+                        _slot_address(fs, &fs->write) + fs->slot_header_size,
+                        object, fs->object_size);
+                _slot_set_status(fs, &fs->write, SLOT_VALID);
+            }
+            _sector_add_valid(fs, fs->write.sector, chunk);
+            for (int i=0; i<chunk; i++)
+                _sector_add_key(fs, object + i * fs->object_size, fs->object_size);
+
+            fs->write.slot += chunk;
+            object += chunk * fs->object_size;
+            count -= chunk;
+            run -= chunk;
+        }
+
+        /* Step into the next sector if this one is full. */
+        if (fs->write.slot >= fs->slots_per_sector)
+            _loc_advance_sector(fs, &fs->write);
+    }
+    _write_publish(fs);
+
+    _checkpoint_update(fs);
+
+    return 0;
+}
+
+int ringfs_fetch(struct ringfs *fs, void *object)
+{
+    STATS_CALL(fs, RINGFS_CALL_FETCH);
+
+    if (fs->features & RINGFS_FEATURE_VARIABLE)
+        return -1;
+    fs->cursor_used = 1;
+
+    /* Advance forward in search of a valid slot. */
+    while (!_loc_equal(&fs->cursor, &fs->write)) {
+        uint32_t status;
+
+        _slot_get_status(fs, &fs->cursor, &status);
+
+        if (status == SLOT_VALID) {
+            _flash_read(fs, fs->flash,
+                    _slot_address(fs, &fs->cursor) + fs->slot_header_size,
+                    object, fs->object_size);
+            _cursor_advance_slot(fs, true);
+            return 0;
+        }
+
+        _cursor_advance_slot(fs, false);
+    }
+
+    return -1;
+}
+
+int ringfs_fetch_var(struct ringfs *fs, void *object, int *size)
+{
+    STATS_CALL(fs, RINGFS_CALL_FETCH);
+
+    if (!(fs->features & RINGFS_FEATURE_VARIABLE))
+        return -1;
+    fs->cursor_used = 1;
+
+    /* Advance forward in search of a valid record. */
+    while (!_loc_equal(&fs->cursor, &fs->write)) {
+        uint32_t status;
+        int length;
+        int record = _record_get(fs, &fs->cursor, &status, &length);
+
+        if (status == SLOT_VALID) {
+            _flash_read(fs, fs->flash,
+                    _slot_address(fs, &fs->cursor) + sizeof(struct record_header),
+                    object, length);
+            *size = length;
+            _cursor_advance_record(fs, record, true);
+            return 0;
+        }
+
+        _cursor_advance_record(fs, record, false);
+    }
+
+    return -1;
+}
+
+int ringfs_fetch_many(struct ringfs *fs, void *objects, int max, int *fetched)
+{
+    uint8_t *buffer = objects;
+    int slot_size = fs->slot_size;
+    int count = 0;
+
+    STATS_CALL(fs, RINGFS_CALL_FETCH);
+
+    if (fs->features & RINGFS_FEATURE_VARIABLE)
+        return -1;
+    fs->cursor_used = 1;
+
+    while (count < max && !_loc_equal(&fs->cursor, &fs->write)) {
+        uint8_t *dest = buffer + count * fs->object_size;
+
+        /* Raw slots are larger than objects; see how many fit in what's left
+         * of the buffer. If not even one does, fall back to a plain fetch. */
+        int run = (max - count) * fs->object_size / slot_size;
+        if (run == 0) {
+            if (ringfs_fetch(fs, dest) != 0)
+                break;
+            count++;
+            continue;
+        }
+
+        /* Don't cross the end of the sector or the write head. */
+        int available = fs->slots_per_sector - fs->cursor.slot;
+        if (fs->cursor.sector == fs->write.sector)
+            available = fs->write.slot - fs->cursor.slot;
+        if (run > available)
+            run = available;
+
+        /* Read the whole run at once, then pick out the valid objects. The
+         * objects are packed towards the start of the buffer, so they never
+         * overwrite slots that haven't been looked at yet. */
+        _flash_read(fs, fs->flash, _slot_address(fs, &fs->cursor), dest, run * slot_size);
+        for (int i=0; i<run; i++) {
+            const uint8_t *slot = dest + i * slot_size;
+            uint32_t status = _status_decode(fs, slot + offsetof(struct slot_header, status), 3);
+            if (status == SLOT_VALID) {
+                memmove(buffer + count * fs->object_size, slot + fs->slot_header_size, fs->object_size);
+                count++;
+                if (fs->cursor_valid >= 0)
+                    fs->cursor_valid++;
+            }
+        }
+
+        fs->cursor.slot += run;
+        if (fs->cursor.slot >= fs->slots_per_sector) {
+            _loc_advance_sector(fs, &fs->cursor);
+            fs->cursor_valid = 0;
+        }
+    }
 
-static bool _loc_equal(struct ringfs_loc *a, struct ringfs_loc *b)
-{
-    return (a->sector == b->sector) && (a->slot == b->slot);
+    *fetched = count;
+    return count > 0 ? 0 : -1;
 }
 
-/** Advance a location to the beginning of the next sector. */
-static void _loc_advance_sector(struct ringfs *fs, struct ringfs_loc *loc)
+int ringfs_peek(struct ringfs *fs, const void **object, void *buffer)
 {
-    loc->slot = 0;
-    loc->sector++;
-    if (loc->sector >= fs->flash->sector_count)
-        loc->sector = 0;
+    int peeked;
+    return ringfs_peek_many(fs, object, 1, &peeked, buffer);
 }
 
-/** Advance a location to the next slot, advancing the sector too if needed. */
-static void _loc_advance_slot(struct ringfs *fs, struct ringfs_loc *loc)
+int ringfs_peek_many(struct ringfs *fs, const void **objects, int max, int *peeked, void *buffer)
 {
-    loc->slot++;
-    if (loc->slot >= fs->slots_per_sector)
-        _loc_advance_sector(fs, loc);
+    STATS_CALL(fs, RINGFS_CALL_FETCH);
+
+    if (fs->features & RINGFS_FEATURE_VARIABLE)
+        return -1;
+    fs->cursor_used = 1;
+
+    int slot_size = fs->slot_size;
+    int count = 0;
+
+    /* Without a mapping, copy the objects and point into the buffer. */
+    if (!fs->flash->map) {
+        int result = ringfs_fetch_many(fs, buffer, max, peeked);
+        for (int i=0; i<*peeked; i++)
+            objects[i] = (uint8_t *) buffer + i * fs->object_size;
+        return result;
+    }
+
+    while (count < max && !_loc_equal(&fs->cursor, &fs->write)) {
+        /* Map what's left of the sector, up to the write head. */
+        int run = fs->slots_per_sector - fs->cursor.slot;
+        if (fs->cursor.sector == fs->write.sector)
+            run = fs->write.slot - fs->cursor.slot;
+
+        const uint8_t *slot = fs->flash->map(fs->flash, _slot_address(fs, &fs->cursor), run * slot_size);
+        if (!slot)
+            break;
+
+        for (int i=0; i<run && count<max; i++, slot += slot_size) {
+            uint32_t status = _status_decode(fs, slot + offsetof(struct slot_header, status), 3);
+            bool valid = (status == SLOT_VALID);
+            if (valid)
+                objects[count++] = slot + fs->slot_header_size;
+            _cursor_advance_slot(fs, valid);
+        }
+    }
+
+    *peeked = count;
+    return count > 0 ? 0 : -1;
 }
 
 /**
- * @}
+ * Discard everything between the read head and a location in the ring. The
+ * number of valid objects passed in the location's sector is given for the
+ * sector table, or -1 if not known.
  */
+static void _discard_to(struct ringfs *fs, const struct ringfs_loc *to, int valid)
+{
+    /* Take the objects between the read head and the location off the counts. */
+    if (fs->sectors) {
+        for (int sector = fs->read.sector; sector != to->sector;
+                sector = (sector + 1) % fs->flash->sector_count)
+            fs->sectors[sector].valid = 0;
+        if (valid >= 0)
+            _sector_add_valid(fs, to->sector, -valid);
+        else
+            fs->sectors[to->sector].valid = -1;
+    }
 
-/* And here we go. */
+    if (fs->read.sector != to->sector) {
+        /* If everything up to a FREE write sector goes, mark that sector as
+         * used first: there must always be an IN_USE sector for ringfs_scan()
+         * to find the write head by. */
+        if (to->sector == fs->write.sector) {
+            uint32_t status;
+            _sector_get_status(fs, fs->write.sector, &status);
+            /* With background erase, it may not be erased yet. */
+            if (status == SECTOR_ERASING || status == SECTOR_ERASED) {
+                _sector_free(fs, fs->write.sector);
+                status = SECTOR_FREE;
+            }
+            if (status == SECTOR_FREE)
+                _write_sector_use(fs);
+        }
 
-int ringfs_init(struct ringfs *fs, struct ringfs_flash_partition *flash, uint32_t version, int object_size)
-{
-    /* Copy arguments to instance. */
-    fs->flash = flash;
-    fs->version = version;
-    fs->object_size = object_size;
+        /* Retire the sectors left behind as a whole. They're erased later on,
+         * once the write head needs them. */
+        while (fs->read.sector != to->sector) {
+            _sector_set_status(fs, fs->read.sector, SECTOR_ERASING);
+            _loc_advance_sector(fs, &fs->read);
+            fs->read_marks = 0;
+        }
+    }
 
-    /* Precalculate commonly used values. */
-    fs->slots_per_sector = (fs->flash->sector_size - sizeof(struct sector_header)) /
-                           (sizeof(struct slot_header) + fs->object_size);
+    /* Then persist how far the read sector has been consumed: with a single
+     * discard mark if one is left, one slot at a time otherwise. */
+    if (fs->read.slot < to->slot) {
+        if ((fs->features & RINGFS_FEATURE_DISCARD_MARKS) && fs->read_marks < RINGFS_DISCARD_MARKS) {
+            _sector_set_mark(fs, fs->read.sector, fs->read_marks++, to->slot);
+            fs->read = *to;
+        }
+        while (!_loc_equal(&fs->read, to))
+            _slot_discard(fs, &fs->read);
+    }
 
-    return 0;
+    _cursors_follow(fs);
+
+    _checkpoint_update(fs);
 }
 
-int ringfs_format(struct ringfs *fs)
+int ringfs_discard(struct ringfs *fs)
 {
-    /* Mark all sectors to prevent half-erased filesystems. */
-    for (int sector=0; sector<fs->flash->sector_count; sector++)
-        _sector_set_status(fs, sector, SECTOR_FORMATTING);
+    STATS_CALL(fs, RINGFS_CALL_DISCARD);
 
-    /* Erase, update version, mark as free. */
-    for (int sector=0; sector<fs->flash->sector_count; sector++)
-        _sector_free(fs, sector);
+    struct ringfs_consumer *slowest = _consumer_slowest(fs);
 
-    /* Start reading & writing at the first sector. */
-    fs->read.sector = 0;
-    fs->read.slot = 0;
-    fs->write.sector = 0;
-    fs->write.slot = 0;
-    fs->cursor.sector = 0;
-    fs->cursor.slot = 0;
+    /* Consumers that haven't got this far yet hold the rest back. */
+    if (slowest && _loc_offset(fs, &slowest->done) < _loc_offset(fs, &fs->cursor)) {
+        if (_loc_offset(fs, &slowest->done) > 0) {
+            if (fs->cursor.sector == slowest->done.sector)
+                fs->cursor_valid = -1;
+            _discard_to(fs, &slowest->done, -1);
+        }
+        return 0;
+    }
+
+    _discard_to(fs, &fs->cursor, fs->cursor_valid);
+    fs->cursor_valid = 0;
 
     return 0;
 }
 
-int ringfs_scan(struct ringfs *fs)
+int ringfs_item_discard(struct ringfs *fs)
 {
-    uint32_t previous_sector_status = SECTOR_FREE;
-    /* The read sector is the first IN_USE sector *after* a FREE sector
-     * (or the first one). */
-    int read_sector = 0;
-    /* The write sector is the last IN_USE sector *before* a FREE sector
-     * (or the last one). */
-    int write_sector = fs->flash->sector_count - 1;
-    /* There must be at least one FREE sector available at all times. */
-    bool free_seen = false;
-    /* If there's no IN_USE sector, we start at the first one. */
-    bool used_seen = false;
+    STATS_CALL(fs, RINGFS_CALL_DISCARD);
 
-    /* Iterate over sectors. */
-    for (int sector=0; sector<fs->flash->sector_count; sector++) {
-        int addr = _sector_address(fs, sector);
+    if (fs->sectors) {
+        uint32_t status;
+        _slot_get_status(fs, &fs->read, &status);
+        if (status == SLOT_VALID) {
+            _sector_add_valid(fs, fs->read.sector, -1);
+            if (fs->read.sector == fs->cursor.sector && fs->read.slot < fs->cursor.slot &&
+                    fs->cursor_valid > 0)
+                fs->cursor_valid--;
+        }
+    }
 
-        /* Read sector header. */
-        struct sector_header header;
-        fs->flash->read(fs->flash, addr, &header, sizeof(header));
+    _slot_discard(fs, &fs->read);
+    if (fs->read.slot == 0)
+        fs->read_marks = 0;
+    _cursors_follow(fs);
 
-        /* Detect partially-formatted partitions. */
-        if (header.status == SECTOR_FORMATTING) {
-            printf("ringfs_scan: partially formatted partition\r\n");
-            return -1;
-        }
+    _checkpoint_update(fs);
 
-        /* Detect and fix partially erased sectors. */
-        if (header.status == SECTOR_ERASING || header.status == SECTOR_ERASED) {
-            _sector_free(fs, addr);
-            header.status = SECTOR_FREE;
-        }
+    return 0;
+}
 
-        /* Detect corrupted sectors. */
-        if (header.status != SECTOR_FREE && header.status != SECTOR_IN_USE) {
-            printf("ringfs_scan: corrupted sector %d\r\n", sector);
-            return -1;
-        }
+int ringfs_rewind(struct ringfs *fs)
+{
+    fs->cursor = fs->read;
+    fs->cursor_valid = 0;
+    fs->cursor_used = 1;
+    return 0;
+}
 
-        /* Detect obsolete versions. We can't do this earlier because the version
-         * could have been invalid due to a partial erase. */
-        if (header.version != fs->version) {
-            printf("ringfs_scan: incompatible version 0x%08"PRIx32"\r\n", header.version);
-            return -1;
-        }
+int ringfs_tell(struct ringfs *fs, uint32_t *sequence)
+{
+    if (!(fs->features & RINGFS_FEATURE_SEQUENCE))
+        return -1;
 
-        /* Record the presence of a FREE sector. */
-        if (header.status == SECTOR_FREE)
-            free_seen = true;
+    *sequence = _loc_sequence(fs, &fs->cursor);
+    return 0;
+}
 
-        /* Record the presence of a IN_USE sector. */
-        if (header.status == SECTOR_IN_USE)
-            used_seen = true;
+int ringfs_seek(struct ringfs *fs, uint32_t sequence)
+{
+    if (!(fs->features & RINGFS_FEATURE_SEQUENCE))
+        return -1;
 
-        /* Update read & write sectors according to the above rules. */
-        if (header.status == SECTOR_IN_USE && previous_sector_status == SECTOR_FREE)
-            read_sector = sector;
-        if (header.status == SECTOR_FREE && previous_sector_status == SECTOR_IN_USE)
-            write_sector = sector-1;
+    /* Unsigned distances also catch numbers from before the read head. */
+    uint32_t first = _loc_sequence(fs, &fs->read);
+    if (sequence - first > _loc_sequence(fs, &fs->write) - first)
+        return -1;
 
-        previous_sector_status = header.status;
-    }
+    int slot = fs->read.slot + (int) (sequence - first);
+    fs->cursor.sector = (fs->read.sector + slot / fs->slots_per_sector) % fs->flash->sector_count;
+    fs->cursor.slot = slot % fs->slots_per_sector;
+    /* Objects passed in the cursor sector weren't counted on the way. */
+    fs->cursor_valid = fs->cursor.slot == 0 ? 0 : -1;
+    fs->cursor_used = 1;
+    return 0;
+}
+
+int ringfs_seek_key(struct ringfs *fs, uint32_t key)
+{
+    STATS_CALL(fs, RINGFS_CALL_FETCH);
 
-    /* Detect the lack of a FREE sector. */
-    if (!free_seen) {
-        printf("ringfs_scan: invariant violated: no FREE sector found\r\n");
+    if (!(fs->features & RINGFS_FEATURE_KEY_RANGE) || !fs->key)
         return -1;
-    }
 
-    /* Start writing at the first sector if the filesystem is empty. */
-    if (!used_seen) {
-        write_sector = 0;
+    /* The write sector may be empty, but is searched all the same. */
+    struct ringfs_loc loc = fs->read;
+    while (!_sector_in_range(fs, loc.sector, key, 0xFFFFFFFF)) {
+        if (loc.sector == fs->write.sector)
+            return -1;
+        _loc_advance_sector(fs, &loc);
     }
 
-    /* Scan the write sector and skip all occupied slots at the beginning. */
-    fs->write.sector = write_sector;
-    fs->write.slot = 0;
-    while (fs->write.sector == write_sector) {
-        uint32_t status;
-        _slot_get_status(fs, &fs->write, &status);
-        if (status == SLOT_ERASED)
-            break;
+    fs->cursor = loc;
+    fs->cursor_valid = 0;
+    fs->cursor_used = 1;
+    return 0;
+}
 
-        _loc_advance_slot(fs, &fs->write);
-    }
-    /* If the sector was full, we're at the beginning of a FREE sector now. */
+int ringfs_fetch_range(struct ringfs *fs, uint32_t min, uint32_t max, void *object, int *size)
+{
+    STATS_CALL(fs, RINGFS_CALL_FETCH);
 
-    /* Position the read head at the start of the first IN_USE sector, then skip
-     * over garbage/invalid slots until something of value is found or we reach
-     * the write head which means there's no data. */
-    fs->read.sector = read_sector;
-    fs->read.slot = 0;
-    while (!_loc_equal(&fs->read, &fs->write)) {
-        uint32_t status;
-        _slot_get_status(fs, &fs->read, &status);
-        if (status == SLOT_VALID)
+    if (!(fs->features & RINGFS_FEATURE_KEY_RANGE) || !fs->key)
+        return -1;
+    fs->cursor_used = 1;
+
+    int checked = -1;
+    while (!_loc_equal(&fs->cursor, &fs->write)) {
+        /* Look at the key range once for every sector entered. */
+        if (fs->cursor.sector != checked) {
+            checked = fs->cursor.sector;
+            if (!_sector_in_range(fs, checked, min, max)) {
+                if (checked == fs->write.sector) {
+                    fs->cursor = fs->write;
+                    fs->cursor_valid = fs->cursor.slot == 0 ? 0 : -1;
+                    break;
+                }
+                _loc_advance_sector(fs, &fs->cursor);
+                fs->cursor_valid = 0;
+                continue;
+            }
+        }
+
+        int result;
+        if (fs->features & RINGFS_FEATURE_VARIABLE) {
+            result = ringfs_fetch_var(fs, object, size);
+        } else {
+            result = ringfs_fetch(fs, object);
+            *size = fs->object_size;
+        }
+        if (result != 0)
             break;
 
-        _loc_advance_slot(fs, &fs->read);
+        uint32_t key = fs->key(object, *size);
+        if (key >= min && key <= max)
+            return 0;
     }
 
-    /* Move the read cursor to the read head position. */
-    fs->cursor = fs->read;
-
-    return 0;
+    return -1;
 }
 
-int ringfs_capacity(struct ringfs *fs)
+int ringfs_consumer_add(struct ringfs *fs, struct ringfs_consumer *consumer, const char *name)
 {
-    return fs->slots_per_sector * (fs->flash->sector_count - 1);
+    consumer->name = name;
+    consumer->cursor = fs->read;
+    consumer->done = fs->read;
+    consumer->next = fs->consumers;
+    fs->consumers = consumer;
+    return 0;
 }
 
-int ringfs_count_estimate(struct ringfs *fs)
+int ringfs_consumer_remove(struct ringfs *fs, struct ringfs_consumer *consumer)
 {
-    int sector_diff = (fs->write.sector - fs->read.sector + fs->flash->sector_count) %
-        fs->flash->sector_count;
+    for (struct ringfs_consumer **c = &fs->consumers; *c; c = &(*c)->next) {
+        if (*c == consumer) {
+            *c = consumer->next;
+            return 0;
+        }
+    }
 
-    return sector_diff * fs->slots_per_sector + fs->write.slot - fs->read.slot;
+    return -1;
 }
 
-int ringfs_count_exact(struct ringfs *fs)
+struct ringfs_consumer *ringfs_consumer_find(struct ringfs *fs, const char *name)
 {
-    int count = 0;
+    for (struct ringfs_consumer *c = fs->consumers; c; c = c->next)
+        if (strcmp(c->name, name) == 0)
+            return c;
 
-    /* Use a temporary loc for iteration. */
-    struct ringfs_loc loc = fs->read;
-    while (!_loc_equal(&loc, &fs->write)) {
-        uint32_t status;
-        _slot_get_status(fs, &loc, &status);
-        
-        if (status == SLOT_VALID)
-            count++;
+    return NULL;
+}
 
-        _loc_advance_slot(fs, &loc);
-    }
+/** Swap a consumer's cursor in for the main one, so the fetch calls can be reused. */
+static void _consumer_swap(struct ringfs *fs, struct ringfs_consumer *consumer)
+{
+    struct ringfs_loc cursor = fs->cursor;
+    fs->cursor = consumer->cursor;
+    consumer->cursor = cursor;
+}
 
-    return count;
+int ringfs_consumer_fetch(struct ringfs *fs, struct ringfs_consumer *consumer, void *object)
+{
+    int cursor_valid = fs->cursor_valid;
+    int cursor_used = fs->cursor_used;
+    _consumer_swap(fs, consumer);
+    int result = ringfs_fetch(fs, object);
+    _consumer_swap(fs, consumer);
+    fs->cursor_valid = cursor_valid;
+    fs->cursor_used = cursor_used;
+    return result;
 }
 
-int ringfs_append(struct ringfs *fs, const void *object)
+int ringfs_consumer_fetch_var(struct ringfs *fs, struct ringfs_consumer *consumer, void *object, int *size)
 {
-    uint32_t status;
+    int cursor_valid = fs->cursor_valid;
+    int cursor_used = fs->cursor_used;
+    _consumer_swap(fs, consumer);
+    int result = ringfs_fetch_var(fs, object, size);
+    _consumer_swap(fs, consumer);
+    fs->cursor_valid = cursor_valid;
+    fs->cursor_used = cursor_used;
+    return result;
+}
 
-    /*
-     * There are three sectors involved in appending a value:
-     * - the sector where the append happens: it has to be writable
-     * - the next sector: it must be free (invariant)
-     * - the next-next sector: read & cursor heads are moved there if needed
-     */
+int ringfs_consumer_rewind(struct ringfs *fs, struct ringfs_consumer *consumer)
+{
+    (void) fs;
+    consumer->cursor = consumer->done;
+    return 0;
+}
 
-    /* Make sure the next sector is free. */
-    int next_sector = (fs->write.sector+1) % fs->flash->sector_count;
-    _sector_get_status(fs, next_sector, &status);
-    if (status != SECTOR_FREE) {
-        /* Next sector must be freed. But first... */
+int ringfs_consumer_discard(struct ringfs *fs, struct ringfs_consumer *consumer)
+{
+    STATS_CALL(fs, RINGFS_CALL_DISCARD);
 
-        /* Move the read & cursor heads out of the way. */
-        if (fs->read.sector == next_sector)
-            _loc_advance_sector(fs, &fs->read);
-        if (fs->cursor.sector == next_sector)
-            _loc_advance_sector(fs, &fs->cursor);
+    consumer->done = consumer->cursor;
 
-        /* Free the next sector. */
-        _sector_free(fs, next_sector);
+    /* Reclaim what every consumer is done with, the main cursor included once
+     * it's been used. */
+    struct ringfs_consumer *slowest = _consumer_slowest(fs);
+    if (fs->cursor_used && _loc_offset(fs, &fs->cursor) < _loc_offset(fs, &slowest->done)) {
+        if (_loc_offset(fs, &fs->cursor) > 0) {
+            _discard_to(fs, &fs->cursor, fs->cursor_valid);
+            fs->cursor_valid = 0;
+        }
+    } else if (_loc_offset(fs, &slowest->done) > 0) {
+        if (fs->cursor.sector == slowest->done.sector)
+            fs->cursor_valid = -1;
+        _discard_to(fs, &slowest->done, -1);
     }
 
-    /* Now we can make sure the current write sector is writable. */
-    _sector_get_status(fs, fs->write.sector, &status);
-    if (status == SECTOR_FREE) {
-        /* Free sector. Mark as used. */
-        _sector_set_status(fs, fs->write.sector, SECTOR_IN_USE);
-    } else if (status != SECTOR_IN_USE) {
-        printf("ringfs_append: corrupted filesystem\r\n");
-        return -1;
-    }
+    return 0;
+}
 
-    /* Preallocate slot. */
-    _slot_set_status(fs, &fs->write, SLOT_RESERVED);
+int ringfs_wear_report(struct ringfs *fs, struct ringfs_wear *wear)
+{
+    uint64_t total = 0;
 
-    /* Write object. */
-    fs->flash->program(fs->flash,
-            _slot_address(fs, &fs->write) + sizeof(struct slot_header),
-            object, fs->object_size);
+    if (!(fs->features & RINGFS_FEATURE_ERASE_COUNT))
+        return -1;
 
-    /* Commit write. */
-    _slot_set_status(fs, &fs->write, SLOT_VALID);
+    STATS_CALL(fs, RINGFS_CALL_OTHER);
 
-    /* Advance the write head. */
-    _loc_advance_slot(fs, &fs->write);
+    /* Sectors whose count was lost are left out. */
+    wear->sectors = 0;
+    for (int sector=0; sector<fs->flash->sector_count; sector++) {
+        uint32_t count;
+        if (_sector_get_erase_count(fs, sector, &count) != 0)
+            continue;
+        if (wear->sectors == 0 || count < wear->min)
+            wear->min = count;
+        if (wear->sectors == 0 || count > wear->max)
+            wear->max = count;
+        total += count;
+        wear->sectors++;
+    }
 
+    if (wear->sectors == 0)
+        return -1;
+    wear->mean = total / wear->sectors;
     return 0;
 }
 
-int ringfs_fetch(struct ringfs *fs, void *object)
+#ifdef RINGFS_STATS
+int ringfs_stats_get(struct ringfs *fs, struct ringfs_stats *stats)
 {
-    /* Advance forward in search of a valid slot. */
-    while (!_loc_equal(&fs->cursor, &fs->write)) {
-        uint32_t status;
-
-        _slot_get_status(fs, &fs->cursor, &status);
+    *stats = fs->stats;
+    return 0;
+}
 
-        if (status == SLOT_VALID) {
-            fs->flash->read(fs->flash,
-                    _slot_address(fs, &fs->cursor) + sizeof(struct slot_header),
-                    object, fs->object_size);
-            _loc_advance_slot(fs, &fs->cursor);
-            return 0;
-        }
+int ringfs_stats_reset(struct ringfs *fs)
+{
+    memset(&fs->stats, 0, sizeof(fs->stats));
+    fs->stats_call = RINGFS_CALL_OTHER;
+    return 0;
+}
+#endif
 
-        _loc_advance_slot(fs, &fs->cursor);
-    }
+int ringfs_sync(struct ringfs *fs)
+{
+    STATS_CALL(fs, RINGFS_CALL_OTHER);
 
-    return -1;
+    return _flash_sync(fs);
 }
 
-int ringfs_discard(struct ringfs *fs)
+int ringfs_coalesce_init(struct ringfs_coalesce *coalesce, struct ringfs_flash_partition *lower,
+        void *page, int page_size)
 {
-    while (!_loc_equal(&fs->read, &fs->cursor)) {
-        _slot_set_status(fs, &fs->read, SLOT_GARBAGE);
-        _loc_advance_slot(fs, &fs->read);
-    }
+    if (page_size <= 0 || lower->sector_size % page_size != 0)
+        return -1;
 
+    struct ringfs_flash_partition flash = {
+        .sector_size = lower->sector_size,
+        .sector_offset = lower->sector_offset,
+        .sector_count = lower->sector_count,
+
+        .sector_erase = _coalesce_sector_erase,
+        .program = _coalesce_program,
+        .read = _coalesce_read,
+        .map = lower->map ? _coalesce_map : NULL,
+        .sector_erase_start = lower->sector_erase_start ? _coalesce_sector_erase_start : NULL,
+        .busy = lower->busy ? _coalesce_busy : NULL,
+        .sync = _coalesce_sync,
+    };
+    coalesce->flash = flash;
+    coalesce->lower = lower;
+    coalesce->page = page;
+    coalesce->page_size = page_size;
+    coalesce->page_address = -1;
     return 0;
 }
 
-int ringfs_item_discard(struct ringfs *fs)
+int ringfs_coalesce_flush(struct ringfs_coalesce *coalesce)
 {
-        _slot_set_status(fs, &fs->read, SLOT_GARBAGE);
-        _loc_advance_slot(fs, &fs->read);
+    struct ringfs_flash_partition *lower = coalesce->lower;
+
+    if (coalesce->page_address >= 0) {
+        int address = coalesce->page_address + coalesce->dirty_start;
+        int size = coalesce->dirty_end - coalesce->dirty_start;
+        coalesce->page_address = -1;
+        if (size > 0 && lower->program(lower, address, coalesce->page + coalesce->dirty_start, size) != size)
+            return -1;
+    }
 
+    /* Drivers that hold programs back themselves get synced too. */
+    if (lower->sync)
+        return lower->sync(lower);
     return 0;
 }
 
-int ringfs_rewind(struct ringfs *fs)
+int ringfs_stripe_init(struct ringfs_stripe *stripe, struct ringfs_flash_partition **devices,
+        int device_count)
 {
-    fs->cursor = fs->read;
+    if (device_count <= 0)
+        return -1;
+
+    int sector_count = devices[0]->sector_count;
+    bool erase_start = true;
+    bool map = true;
+    bool sync = false;
+    for (int i=0; i<device_count; i++) {
+        if (devices[i]->sector_size != devices[0]->sector_size)
+            return -1;
+        if (devices[i]->sector_count < sector_count)
+            sector_count = devices[i]->sector_count;
+        erase_start = erase_start && devices[i]->sector_erase_start && devices[i]->busy;
+        map = map && devices[i]->map;
+        sync = sync || devices[i]->sync;
+    }
+    if (sector_count <= 0)
+        return -1;
+
+    struct ringfs_flash_partition flash = {
+        .sector_size = devices[0]->sector_size,
+        .sector_offset = 0,
+        .sector_count = sector_count * device_count,
+
+        .sector_erase = _stripe_sector_erase,
+        .program = _stripe_program,
+        .read = _stripe_read,
+        .map = map ? _stripe_map : NULL,
+        .sector_erase_start = erase_start ? _stripe_sector_erase_start : NULL,
+        .busy = erase_start ? _stripe_busy : NULL,
+        .sync = sync ? _stripe_sync : NULL,
+    };
+    stripe->flash = flash;
+    stripe->devices = devices;
+    stripe->device_count = device_count;
+    stripe->erasing = -1;
     return 0;
 }
 
@@ -420,17 +2803,17 @@ void ringfs_dump(FILE *stream, struct ringfs *fs)
 {
     const char *description;
 
+    STATS_CALL(fs, RINGFS_CALL_OTHER);
+
     fprintf(stream, "RingFS read: {%d,%d} cursor: {%d,%d} write: {%d,%d}\n",
             fs->read.sector, fs->read.slot,
             fs->cursor.sector, fs->cursor.slot,
             fs->write.sector, fs->write.slot);
 
     for (int sector=0; sector<fs->flash->sector_count; sector++) {
-        int addr = _sector_address(fs, sector);
-
         /* Read sector header. */
         struct sector_header header;
-        fs->flash->read(fs->flash, addr, &header, sizeof(header));
+        _sector_get_header(fs, sector, &header);
 
         switch (header.status) {
             case SECTOR_ERASED: description = "ERASED"; break;
@@ -444,10 +2827,15 @@ void ringfs_dump(FILE *stream, struct ringfs *fs)
         fprintf(stream, "[%04d] [v=0x%08"PRIx32"] [%-10s] ",
                 sector, header.version, description);
 
-        for (int slot=0; slot<fs->slots_per_sector; slot++) {
-            struct ringfs_loc loc = { sector, slot };
+        for (struct ringfs_loc loc = { sector, 0 }; loc.slot < fs->slots_per_sector; ) {
             uint32_t status;
-            _slot_get_status(fs, &loc, &status);
+            if (fs->features & RINGFS_FEATURE_VARIABLE) {
+                int length;
+                loc.slot += _record_get(fs, &loc, &status, &length);
+            } else {
+                _slot_get_status(fs, &loc, &status);
+                loc.slot++;
+            }
 
             switch (status) {
                 case SLOT_ERASED: description = "E"; break;
@@ -18,6 +18,15 @@
 #include <stdio.h>
 #include <unistd.h>
 
+#ifndef RINGFS_CACHE_WINDOWS
+/** Most windows a read cache can be split into, see ringfs_set_read_cache(). */
+#define RINGFS_CACHE_WINDOWS 4
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * Flash memory+parition descriptor.
  */
@@ -49,6 +58,71 @@ struct ringfs_flash_partition
      * @returns size on success, -1 on failure.
      */
     ssize_t (*read)(struct ringfs_flash_partition *flash, int address, void *data, size_t size);
+    /**
+     * Map flash memory for direct reading. Optional, may be NULL.
+     * The pointer must stay valid until the memory is erased.
+     * @param address Start address, in bytes.
+     * @param size Size of the mapped range.
+     * @returns Pointer to the mapped range, NULL on failure.
+     */
+    const void *(*map)(struct ringfs_flash_partition *flash, int address, size_t size);
+    /**
+     * Start erasing a sector without waiting for it to finish. Optional, may be
+     * NULL; requires busy. Reads and programs of other sectors may happen
+     * before the erase completes, so the driver has to suspend it as needed.
+     * @param address Any address inside the sector.
+     * @returns Zero on success, -1 on failure.
+     */
+    int (*sector_erase_start)(struct ringfs_flash_partition *flash, int address);
+    /**
+     * Check whether an erase started by sector_erase_start is still running.
+     * @returns Positive while busy, zero when done.
+     */
+    int (*busy)(struct ringfs_flash_partition *flash);
+    /**
+     * Make every program issued so far durable, for drivers that hold them
+     * back. Optional, may be NULL. RingFS calls it wherever the order of
+     * programs matters for power loss safety: between preparing and
+     * committing an object, and around sector state changes.
+     * @returns Zero on success, -1 on failure.
+     */
+    int (*sync)(struct ringfs_flash_partition *flash);
+};
+
+/**
+ * Write coalescing layer, see ringfs_coalesce_init(). Sits between RingFS and
+ * the flash driver, collecting programs to one flash page in RAM.
+ */
+struct ringfs_coalesce {
+    struct ringfs_flash_partition flash; /**< Partition to pass to ringfs_init(). Must come first. */
+    struct ringfs_flash_partition *lower; /**< Underlying flash driver. */
+    uint8_t *page;                      /**< Pending bits of the buffered page, 0xFF elsewhere. */
+    int page_size;
+    int page_address;                   /**< Address of the buffered page, -1 if none. */
+    int dirty_start;                    /**< Pending byte range within the page. */
+    int dirty_end;
+};
+
+/**
+ * Striping layer, see ringfs_stripe_init(). Sits between RingFS and several
+ * flash drivers, placing consecutive sectors on each device in turn.
+ */
+struct ringfs_stripe {
+    struct ringfs_flash_partition flash; /**< Partition to pass to ringfs_init(). Must come first. */
+    struct ringfs_flash_partition **devices; /**< Underlying flash drivers. */
+    int device_count;
+    int erasing;                        /**< Device with an erase in progress, -1 if none. */
+};
+
+/**
+ * Optional on-flash format features, see ringfs_set_features().
+ */
+enum ringfs_feature {
+    RINGFS_FEATURE_DISCARD_MARKS = 1 << 0, /**< Record partial discards in sector headers. */
+    RINGFS_FEATURE_VARIABLE      = 1 << 1, /**< Variable length records, object_size is the maximum. */
+    RINGFS_FEATURE_SEQUENCE      = 1 << 2, /**< Sequence numbers, see ringfs_seek(). */
+    RINGFS_FEATURE_KEY_RANGE     = 1 << 3, /**< Per-sector key ranges, see ringfs_set_key(). */
+    RINGFS_FEATURE_ERASE_COUNT   = 1 << 4, /**< Per-sector erase counts, see ringfs_wear_report(). */
 };
 
 /** @private */
@@ -57,6 +131,67 @@ struct ringfs_loc {
     int slot;
 };
 
+/**
+ * Named consumer with a fetch position of its own. See ringfs_consumer_add().
+ * Structure fields should not be accessed directly.
+ */
+struct ringfs_consumer {
+    const char *name;
+    struct ringfs_loc cursor;   /**< Next object to fetch. */
+    struct ringfs_loc done;     /**< Everything before has been discarded. */
+    struct ringfs_consumer *next;
+};
+
+/**
+ * In-RAM state of a single sector. See ringfs_set_sector_table().
+ * Structure fields should not be accessed directly.
+ */
+struct ringfs_sector_info {
+    uint32_t status;
+    int valid;                  /**< Valid objects at or after the read head, -1 if not counted yet. */
+};
+
+/**
+ * Erase counts across the partition, see ringfs_wear_report().
+ */
+struct ringfs_wear {
+    uint32_t min;
+    uint32_t max;
+    uint32_t mean;
+    int sectors;                /**< Sectors with a known erase count. */
+};
+
+#ifdef RINGFS_STATS
+/**
+ * API calls flash ops are attributed to, see ringfs_stats_get().
+ */
+enum ringfs_stats_call {
+    RINGFS_CALL_FORMAT,         /**< ringfs_format() */
+    RINGFS_CALL_SCAN,           /**< ringfs_scan() */
+    RINGFS_CALL_APPEND,         /**< All ringfs_append*() calls. */
+    RINGFS_CALL_FETCH,          /**< Fetch, peek and seek calls. */
+    RINGFS_CALL_DISCARD,        /**< All discard calls. */
+    RINGFS_CALL_POLL,           /**< ringfs_poll() */
+    RINGFS_CALL_COUNT_EXACT,    /**< ringfs_count_exact() */
+    RINGFS_CALL_OTHER,          /**< Anything else. */
+    RINGFS_CALLS,
+};
+
+/** Flash ops done by one kind of API call. */
+struct ringfs_stats_ops {
+    uint32_t reads;
+    uint32_t read_bytes;
+    uint32_t programs;
+    uint32_t program_bytes;
+    uint32_t erases;            /**< Including those started with sector_erase_start. */
+};
+
+/** Flash op counters, see ringfs_stats_get(). */
+struct ringfs_stats {
+    struct ringfs_stats_ops calls[RINGFS_CALLS];
+};
+#endif
+
 /**
  * RingFS instance. Should be initialized with ringfs_init() befure use.
  * Structure fields should not be accessed directly.
@@ -66,13 +201,71 @@ struct ringfs {
     struct ringfs_flash_partition *flash;
     uint32_t version;
     int object_size;
+    uint32_t features;
+    int program_unit;
     /* Cached values. */
     int slots_per_sector;
+    int sector_header_size;
+    int slot_header_size;
+    int slot_size;
 
     /* Read/write pointers. Modified as needed. */
     struct ringfs_loc read;
     struct ringfs_loc write;
     struct ringfs_loc cursor;
+    /* Discard marks already used up in the read sector. */
+    int read_marks;
+    /* Sequence number of the first slot in sequence_sector, the sector most
+     * recently taken into use. */
+    int sequence_sector;
+    uint32_t sequence;
+    /* Key callback, and the range of keys appended to key_sector so far. */
+    uint32_t (*key)(const void *object, int size);
+    int key_sector;
+    uint32_t key_min;
+    uint32_t key_max;
+    /* Packed write heads for concurrent appends: next slot to hand out, to
+     * reserve, and to commit. Then the sector that couldn't be prepared for
+     * them, -1 if none. */
+    uint32_t write_next;
+    uint32_t write_reserved;
+    uint32_t write_committed;
+    int write_failed;
+
+    /* Optional caller-supplied buffers. NULL when not in use. */
+    struct ringfs_sector_info *sectors;
+    uint8_t *cache;
+    /* Read cache windows, and the flash address each one holds, or -1. */
+    int cache_window;
+    int cache_windows;
+    int cache_next;
+    int cache_address[RINGFS_CACHE_WINDOWS];
+    /* Valid objects passed by the cursor in its current sector. */
+    int cursor_valid;
+    /* Whether the cursor was used since format or scan. */
+    int cursor_used;
+
+    /* Optional checkpoint log. */
+    struct ringfs_flash_partition *checkpoint;
+    int checkpoint_next;
+    int checkpoint_read;
+    int checkpoint_write;
+
+    /* Optional consumers with their own cursors. */
+    struct ringfs_consumer *consumers;
+
+    /* Optional background erase. */
+    int background_erase;
+    int erasing;
+    uint32_t erasing_count;
+    /* Sectors kept free ahead of the write head. */
+    int reserve;
+
+#ifdef RINGFS_STATS
+    /* Flash op counters, and the call they're currently attributed to. */
+    struct ringfs_stats stats;
+    int stats_call;
+#endif
 };
 
 /**
@@ -88,6 +281,138 @@ struct ringfs {
  */
 int ringfs_init(struct ringfs *fs, struct ringfs_flash_partition *flash, uint32_t version, int object_size);
 
+/**
+ * Enable optional on-flash format features. Features change the layout of the
+ * partition, so they must match whatever the partition was formatted with.
+ * Must be called after ringfs_init() and before ringfs_format()/ringfs_scan().
+ *
+ * RINGFS_FEATURE_DISCARD_MARKS reserves a few words in every sector header to
+ * record how far a sector has been discarded, so ringfs_discard() can persist
+ * a partial discard with a single program instead of one per object.
+ *
+ * RINGFS_FEATURE_VARIABLE stores records of up to object_size bytes, packed
+ * back to back within sectors. Use ringfs_append_var() and ringfs_fetch_var();
+ * the fixed size append and fetch calls fail in this mode, and
+ * ringfs_capacity() and ringfs_count_estimate() count bytes instead of objects.
+ *
+ * RINGFS_FEATURE_SEQUENCE stores the sequence number of the first slot in
+ * every sector header, so every object has a number that survives remounts,
+ * see ringfs_seek(). Can't be combined with RINGFS_FEATURE_VARIABLE.
+ *
+ * RINGFS_FEATURE_KEY_RANGE stores the smallest and largest key of the objects
+ * in every sector header, see ringfs_set_key().
+ *
+ * RINGFS_FEATURE_ERASE_COUNT keeps count of erases in every sector header,
+ * see ringfs_wear_report().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param features Bitwise OR of enum ringfs_feature values.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_set_features(struct ringfs *fs, uint32_t features);
+
+/**
+ * Lay the partition out for flash that programs whole units at a time and
+ * can't reprogram them, like 64 or 256 bit ECC-protected flash. Every step of
+ * a slot or sector status gets a unit to itself, programmed once; header
+ * fields and payloads are padded to whole units. This costs three units per
+ * slot and four per sector header on top of the padding.
+ * Can't be combined with RINGFS_FEATURE_VARIABLE. Must be called after
+ * ringfs_init() and before ringfs_format()/ringfs_scan().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param unit Program unit in bytes, a power of two from 8 to
+ *             RINGFS_MAX_PROGRAM_UNIT; zero for flash that reprograms words.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_set_program_unit(struct ringfs *fs, int unit);
+
+/**
+ * Leave sector erases to ringfs_poll() instead of doing them in the append
+ * that crosses into a new sector. Appends then only mark the sector ahead for
+ * erasing, and erase inline only if it's needed before a poll got to it.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param enable Nonzero to enable, zero to disable.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_set_background_erase(struct ringfs *fs, int enable);
+
+/**
+ * Keep more than one sector free ahead of the write head. Oldest objects are
+ * dropped that many sectors early, which ringfs_capacity() accounts for. With
+ * background erase, bursts of up to that many sectors then land with no erase
+ * at all, and ringfs_poll() catches up afterwards. The default is one sector.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param sectors Number of free sectors, 1 to flash->sector_count - 1.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_set_reserve(struct ringfs *fs, int sectors);
+
+/**
+ * Set the callback that extracts a key, such as a timestamp, from an object.
+ * With RINGFS_FEATURE_KEY_RANGE, the range of keys in each sector is kept in
+ * RAM as objects are appended and stored in the sector header once the write
+ * head moves on, so ringfs_seek_key() and ringfs_fetch_range() can skip the
+ * sectors that don't have any keys of interest. The sector being written when
+ * the filesystem is mounted never gets a range and is always searched.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param key Key callback, given the object and its size. NULL makes every
+ *            sector match every key.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_set_key(struct ringfs *fs, uint32_t (*key)(const void *object, int size));
+
+/**
+ * Keep sector state in RAM instead of reading sector headers back from flash.
+ * The table is filled by ringfs_format() and ringfs_scan() and kept up to date
+ * afterwards, so appends that don't cross a sector boundary read no headers.
+ * It also keeps per-sector object counts, so ringfs_count_exact() only walks
+ * slots of sectors it hasn't counted before.
+ * Must be called after ringfs_init() and before ringfs_format()/ringfs_scan().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param table Array of flash->sector_count entries, or NULL to disable.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_set_sector_table(struct ringfs *fs, struct ringfs_sector_info *table);
+
+/**
+ * Cache flash reads in RAM. The buffer is split into windows of a page or a
+ * sector, each holding an aligned stretch of the partition, so walking slots
+ * in order takes one read per window instead of a couple per slot. Windows
+ * are replaced round robin. Programs and erases done by this instance drop
+ * the windows they touch; nothing else may write to the partition meanwhile.
+ * Reads larger than a window, or crossing windows, go straight to flash.
+ * Not for use with ringfs_append_concurrent().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param buffer Buffer of size bytes, or NULL to disable.
+ * @param size Buffer size; only whole windows, up to RINGFS_CACHE_WINDOWS, are used.
+ * @param window Window size; must divide the sector size.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_set_read_cache(struct ringfs *fs, void *buffer, int size, int window);
+
+/**
+ * Keep a checkpoint log so ringfs_scan() doesn't have to read every sector
+ * header. Every time the read or write head moves to another sector, a small
+ * record is appended to the log; the region is erased only when it fills up.
+ * On scan, the last record is checked against a few sector headers and used
+ * if still accurate; otherwise the full scan runs as usual.
+ *
+ * The region must not overlap the ring partition and only its first sector
+ * is used. It's erased by ringfs_format(). Must be called after ringfs_init()
+ * and before ringfs_format()/ringfs_scan().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param region Flash region for the checkpoint log, or NULL to disable.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_set_checkpoint(struct ringfs *fs, struct ringfs_flash_partition *region);
+
 /**
  * Format the flash memory.
  *
@@ -123,13 +448,26 @@ int ringfs_count_estimate(struct ringfs *fs);
 
 /**
  * Calculate exact object count.
- * Runs in O(n).
+ * Runs in O(n), or O(sectors) with a sector table once every sector has been
+ * counted.
  *
  * @param fs Initialized RingFS instance.
  * @returns Exact object count on success, -1 on failure.
  */
 int ringfs_count_exact(struct ringfs *fs);
 
+/**
+ * Do pending maintenance work, a step at a time. Erases the sectors waiting
+ * for it, starting with those the write head needs first. With the partition's
+ * sector_erase_start op, erases run without blocking and each call either
+ * starts one or checks on it; otherwise each call erases one sector.
+ * Call periodically while idle, until it returns zero.
+ *
+ * @param fs Initialized RingFS instance.
+ * @returns Zero if there's nothing left to do, positive if there is, -1 on failure.
+ */
+int ringfs_poll(struct ringfs *fs);
+
 /**
  * Append an object at the end of the ring. Deletes oldest objects as needed.
  *
@@ -139,6 +477,55 @@ int ringfs_count_exact(struct ringfs *fs);
  */
 int ringfs_append(struct ringfs *fs, const void *object);
 
+/**
+ * Append several objects at once. Equivalent to calling ringfs_append() for
+ * each object, but sector state is checked once per sector crossed and each
+ * run of consecutive slots takes two programs: one reserving and writing it,
+ * one committing it.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param objects Array of objects to be stored, packed back to back.
+ * @param count Number of objects in the array.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_append_batch(struct ringfs *fs, const void *objects, int count);
+
+/**
+ * Append an object; safe to call from several threads at once. Each caller
+ * takes the next slot atomically and programs its object alongside the
+ * others, but slots are reserved and committed in order, so a VALID object
+ * never follows a hole, even after a power loss.
+ *
+ * Needs GCC-style __atomic builtins. Callers wait for each other in
+ * RINGFS_CONCURRENT_WAIT(), which can be defined to yield. There must be
+ * fewer concurrent callers than slots in the ring. Other ringfs_* calls must
+ * not run at the same time. Not available with RINGFS_FEATURE_VARIABLE.
+ *
+ * Objects are programmed while other callers program slot states, so the
+ * flash ops must be safe to call from several threads at once.
+ *
+ * Write heads are packed in 16 bits per sector and slot: partitions of more
+ * than 0xFFFF sectors, or of more than 0xFFFF slots per sector, are refused.
+ * If the sector an object falls in can't be prepared, the appends of every
+ * slot in that sector fail, and the next sector is tried after it.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Object to be stored.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_append_concurrent(struct ringfs *fs, const void *object);
+
+/**
+ * Append a variable length record. Requires RINGFS_FEATURE_VARIABLE.
+ * Records that don't fit the rest of the write sector start a new one.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Record to be stored.
+ * @param size Size of the record, at most object_size bytes.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_append_var(struct ringfs *fs, const void *object, int size);
+
 /**
  * Fetch next object from the ring, oldest-first. Advances read cursor.
  *
@@ -148,8 +535,59 @@ int ringfs_append(struct ringfs *fs, const void *object);
  */
 int ringfs_fetch(struct ringfs *fs, void *object);
 
+/**
+ * Fetch next variable length record. Requires RINGFS_FEATURE_VARIABLE.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Buffer of object_size bytes to store the record.
+ * @param size Set to the size of the record.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_fetch_var(struct ringfs *fs, void *object, int *size);
+
+/**
+ * Fetch up to max objects from the ring, oldest-first. Advances read cursor.
+ * Slots are read in runs of up to a whole sector per flash read.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param objects Buffer to store retrieved objects, max objects long.
+ * @param max Maximum number of objects to retrieve.
+ * @param fetched Number of objects actually retrieved.
+ * @returns Zero if at least one object was retrieved, -1 otherwise.
+ */
+int ringfs_fetch_many(struct ringfs *fs, void *objects, int max, int *fetched);
+
+/**
+ * Fetch next object without copying it, if the flash can be mapped.
+ * Works like ringfs_fetch(), but returns a pointer to the object.
+ * The pointer stays valid until the object is discarded and overwritten.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param object Set to point to the object.
+ * @param buffer Buffer of object_size bytes to copy the object into if the
+ *               partition has no map operation.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_peek(struct ringfs *fs, const void **object, void *buffer);
+
+/**
+ * Fetch up to max objects without copying them, if the flash can be mapped.
+ * Works like ringfs_fetch_many(), but fills an array of object pointers.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param objects Array of max object pointers.
+ * @param max Maximum number of objects to fetch.
+ * @param peeked Set to the number of objects fetched.
+ * @param buffer Buffer of max*object_size bytes to copy objects into if the
+ *               partition has no map operation.
+ * @returns Zero if at least one object was fetched, -1 otherwise.
+ */
+int ringfs_peek_many(struct ringfs *fs, const void **objects, int max, int *peeked, void *buffer);
+
 /**
  * Discard all fetched objects up to the read cursor.
+ * Sectors left behind entirely are retired with a single program each and
+ * erased later, once the write head needs them.
  *
  * @param fs Initialized RingFS instance.
  * @returns Zero on success, -1 on failure.
@@ -166,6 +604,236 @@ int ringfs_item_discard(struct ringfs *fs);
  */
 int ringfs_rewind(struct ringfs *fs);
 
+/**
+ * Get the sequence number of the read cursor position, which is that of the
+ * object the next fetch returns. Every slot has its number, counting up from
+ * zero at ringfs_format() and wrapping around at 2^32; slots left RESERVED by
+ * a power loss use theirs up. Requires RINGFS_FEATURE_SEQUENCE.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param sequence Set to the sequence number.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_tell(struct ringfs *fs, uint32_t *sequence);
+
+/**
+ * Move the read cursor to the object with the given sequence number, as
+ * returned by ringfs_tell(). Runs in O(1).
+ * Requires RINGFS_FEATURE_SEQUENCE.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param sequence Sequence number, between those of the oldest object and
+ *                 the write head.
+ * @returns Zero on success, -1 if the object is no longer (or not yet) there.
+ */
+int ringfs_seek(struct ringfs *fs, uint32_t sequence);
+
+/**
+ * Move the read cursor to the first sector that may have objects with keys
+ * of at least the given one, skipping sectors by their key ranges. Objects
+ * before it in that sector may still have smaller keys. Meant for keys that
+ * grow over time, like timestamps.
+ * Requires RINGFS_FEATURE_KEY_RANGE and a key callback.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param key Key to look for.
+ * @returns Zero on success, -1 if no sector has such keys.
+ */
+int ringfs_seek_key(struct ringfs *fs, uint32_t key);
+
+/**
+ * Fetch the next object with a key between min and max, inclusive. Works like
+ * ringfs_fetch() or ringfs_fetch_var(), but skips the objects out of range,
+ * and whole sectors whose key range doesn't overlap.
+ * Requires RINGFS_FEATURE_KEY_RANGE and a key callback.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param min Smallest key to return.
+ * @param max Largest key to return.
+ * @param object Buffer of object_size bytes to store the object.
+ * @param size Set to the size of the object.
+ * @returns Zero on success, -1 if there are no more objects in range.
+ */
+int ringfs_fetch_range(struct ringfs *fs, uint32_t min, uint32_t max, void *object, int *size);
+
+/**
+ * Register a consumer with its own fetch position, starting at the read head.
+ * Once there are consumers, objects are only reclaimed when all of them have
+ * discarded them; ringfs_discard() doesn't go past the slowest one either.
+ * The main cursor counts as one more consumer once it's used, see
+ * ringfs_consumer_discard().
+ * Positions are kept in RAM only: ringfs_format() and ringfs_scan() start all
+ * consumers over at the read head.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param consumer Consumer to register, owned by the caller.
+ * @param name Consumer name, see ringfs_consumer_find(). Not copied.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_consumer_add(struct ringfs *fs, struct ringfs_consumer *consumer, const char *name);
+
+/**
+ * Unregister a consumer. Objects it held back are reclaimed by the next discard.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param consumer Registered consumer.
+ * @returns Zero on success, -1 if it wasn't registered.
+ */
+int ringfs_consumer_remove(struct ringfs *fs, struct ringfs_consumer *consumer);
+
+/**
+ * Look up a registered consumer by name.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param name Consumer name.
+ * @returns The consumer, or NULL if there's none by that name.
+ */
+struct ringfs_consumer *ringfs_consumer_find(struct ringfs *fs, const char *name);
+
+/**
+ * Fetch the next object for a consumer. Works like ringfs_fetch().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param consumer Registered consumer.
+ * @param object Buffer to store retrieved object.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_consumer_fetch(struct ringfs *fs, struct ringfs_consumer *consumer, void *object);
+
+/**
+ * Fetch the next variable length record for a consumer. Works like
+ * ringfs_fetch_var().
+ *
+ * @param fs Initialized RingFS instance.
+ * @param consumer Registered consumer.
+ * @param object Buffer of object_size bytes to store the record.
+ * @param size Set to the size of the record.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_consumer_fetch_var(struct ringfs *fs, struct ringfs_consumer *consumer, void *object, int *size);
+
+/**
+ * Rewind a consumer to the last object it discarded.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param consumer Registered consumer.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_consumer_rewind(struct ringfs *fs, struct ringfs_consumer *consumer);
+
+/**
+ * Discard all objects a consumer has fetched. They're reclaimed once no other
+ * consumer needs them. Once the main cursor has been used since ringfs_format()
+ * or ringfs_scan(), by ringfs_fetch(), ringfs_rewind() or any other call that
+ * fetches or moves it, objects it hasn't got to yet aren't reclaimed either.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param consumer Registered consumer.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_consumer_discard(struct ringfs *fs, struct ringfs_consumer *consumer);
+
+/**
+ * Report erase counts, to tell how worn out the flash is. Every sector erase
+ * reads the count from the header before erasing and writes it back
+ * incremented after. Reads one word pair per sector.
+ * Requires RINGFS_FEATURE_ERASE_COUNT.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param wear Set to the smallest, largest and mean erase counts.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_wear_report(struct ringfs *fs, struct ringfs_wear *wear);
+
+#ifdef RINGFS_STATS
+/**
+ * Get the flash op counters, broken down by API call. Only available when
+ * built with RINGFS_STATS; counters start at zero in ringfs_init().
+ * Counting isn't exact while ringfs_append_concurrent() runs.
+ *
+ * @param fs Initialized RingFS instance.
+ * @param stats Set to the counters.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_stats_get(struct ringfs *fs, struct ringfs_stats *stats);
+
+/**
+ * Zero the flash op counters. Only available when built with RINGFS_STATS.
+ *
+ * @param fs Initialized RingFS instance.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_stats_reset(struct ringfs *fs);
+#endif
+
+/**
+ * Make every completed call durable, by syncing the flash partition. Only
+ * needed with drivers that hold programs back, like ringfs_coalesce;
+ * otherwise a no-op.
+ *
+ * @param fs Initialized RingFS instance.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_sync(struct ringfs *fs);
+
+/**
+ * Set up a write coalescing layer on top of a flash driver. Programs to the
+ * same flash page are collected in RAM and issued as one, when a program
+ * leaves the page, on sync, and before the page is mapped or a sector is
+ * erased. Programs spanning pages go straight through. Reads see pending
+ * programs. The geometry is copied from the driver.
+ *
+ * Durability: RingFS syncs before committing an object, so a power loss never
+ * leaves a VALID object with a partial payload; but an append is only durable
+ * once a later call has synced, or after ringfs_sync().
+ *
+ * Cost: the commit of one append goes out with the reservation of the next,
+ * so ringfs_append() takes about two programs instead of three while slots
+ * are small next to the page, and two and a half for 128 byte objects in
+ * 256 byte pages. ringfs_append_batch() already merges its programs, which
+ * go straight through. Not for use with ringfs_append_concurrent().
+ *
+ * @param coalesce Layer to set up. Pass &coalesce->flash to ringfs_init().
+ * @param lower Underlying flash driver.
+ * @param page Buffer of page_size bytes.
+ * @param page_size Flash program page size; must divide the sector size.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_coalesce_init(struct ringfs_coalesce *coalesce, struct ringfs_flash_partition *lower,
+        void *page, int page_size);
+
+/**
+ * Issue the pending programs, if any.
+ *
+ * @param coalesce Layer set up with ringfs_coalesce_init().
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_coalesce_flush(struct ringfs_coalesce *coalesce);
+
+/**
+ * Set up a striping layer over several flash devices, so that a single RingFS
+ * instance uses all of them. Sector n of the striped partition is sector
+ * n / device_count of device n % device_count: the write head moves to another
+ * device with every sector, and the on-flash format, scan and object order are
+ * those of an ordinary partition of the combined size.
+ *
+ * Erases overlap with programs when the devices support sector_erase_start and
+ * RingFS erases in the background (see ringfs_set_background_erase()): the
+ * sectors ringfs_poll() erases ahead of the write head are on other devices
+ * than the write sector, as long as the reserve (see ringfs_set_reserve()) is
+ * less than device_count, so appends don't have to suspend the erase.
+ *
+ * All devices must have the same sector size. The smallest device sets how
+ * many sectors of each are used.
+ *
+ * @param stripe Layer to set up. Pass &stripe->flash to ringfs_init().
+ * @param devices Underlying flash drivers, in order. Must stay valid.
+ * @param device_count Number of devices.
+ * @returns Zero on success, -1 on failure.
+ */
+int ringfs_stripe_init(struct ringfs_stripe *stripe, struct ringfs_flash_partition **devices,
+        int device_count);
+
 /**
  * Dump filesystem metadata. For debugging purposes.
  * @param stream File stream to write to.
@@ -173,6 +841,10 @@ int ringfs_rewind(struct ringfs *fs);
  */
 void ringfs_dump(FILE *stream, struct ringfs *fs);
 
+#ifdef __cplusplus
+}
+#endif
+
 /**
  * @}
  */
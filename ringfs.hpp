@@ -0,0 +1,435 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+#ifndef RINGFS_HPP
+#define RINGFS_HPP
+
+/**
+ * @defgroup ringfs_cpp RingFS C++ front-end
+ * @{
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <type_traits>
+
+/**
+ * Header-only C++ version of the core of RingFS, with the partition geometry,
+ * the object size and the flash driver fixed at compile time. Addresses fold
+ * into constants, power-of-two sector counts wrap around with a mask, and
+ * driver calls are plain member calls the compiler can inline.
+ *
+ * The on-flash format is the one ringfs.c uses without optional features, so
+ * either can mount what the other wrote. Feature flags, background erase, a
+ * reserve of more than one sector, checkpoints and consumers are C only.
+ */
+namespace ringfs_cpp {
+
+/**
+ * Partition geometry, see struct ringfs_flash_partition.
+ */
+template <int SectorSize, int SectorOffset, int SectorCount>
+struct Geometry {
+    static constexpr int sector_size = SectorSize;      /**< Sector size, in bytes. */
+    static constexpr int sector_offset = SectorOffset;  /**< Partition offset, in sectors. */
+    static constexpr int sector_count = SectorCount;    /**< Partition size, in sectors. */
+};
+
+/**
+ * RingFS instance storing objects of type Object. The flash driver is any
+ * class with these members, behaving like the ops of struct
+ * ringfs_flash_partition:
+ *
+ *     int sector_erase(int address);
+ *     ssize_t program(int address, const void *data, size_t size);
+ *     ssize_t read(int address, void *data, size_t size);
+ *
+ * Member functions return zero on success and -1 on failure, like their
+ * ringfs_* counterparts.
+ */
+template <typename Object, typename Geometry, typename Flash>
+class Ring {
+    static_assert(std::is_trivially_copyable<Object>::value, "objects are stored as raw bytes");
+
+public:
+    /**
+     * Create an instance. Call format() or scan() before use.
+     * @param flash Flash driver, must outlive the instance.
+     * @param version Object version, as in ringfs_init().
+     */
+    Ring(Flash &flash, uint32_t version) : flash_(flash), version_(version) {}
+
+    /** See ringfs_format(). */
+    int format()
+    {
+        /* Mark all sectors to prevent half-erased filesystems. */
+        for (int sector=0; sector<sector_count; sector++)
+            set_sector_status(sector, SECTOR_FORMATTING);
+
+        /* Erase, update version, mark as free. */
+        for (int sector=0; sector<sector_count; sector++)
+            sector_free(sector);
+
+        read_ = write_ = cursor_ = Loc{0, 0};
+        return 0;
+    }
+
+    /** See ringfs_scan(). */
+    int scan()
+    {
+        bool previous_used = false;
+        int read = 0;
+        int write = sector_count - 1;
+        bool unused_seen = false;
+        bool used_seen = false;
+        int first_free = -1;
+
+        for (int sector=0; sector<sector_count; sector++) {
+            uint32_t header[2];
+            flash_.read(sector_address(sector), header, sizeof(header));
+            uint32_t status = header[0];
+
+            if (status == SECTOR_FORMATTING) {
+                printf("ringfs_scan: partially formatted partition\r\n");
+                return -1;
+            }
+            if (status != SECTOR_FREE && status != SECTOR_IN_USE &&
+                    status != SECTOR_ERASING && status != SECTOR_ERASED) {
+                printf("ringfs_scan: corrupted sector %d\r\n", sector);
+                return -1;
+            }
+            if ((status == SECTOR_FREE || status == SECTOR_IN_USE) && header[1] != version_) {
+                printf("ringfs_scan: incompatible version 0x%08x\r\n", (unsigned) header[1]);
+                return -1;
+            }
+
+            bool used = (status == SECTOR_IN_USE);
+            if (used)
+                used_seen = true;
+            else
+                unused_seen = true;
+            if (status == SECTOR_FREE && first_free < 0)
+                first_free = sector;
+
+            if (used && !previous_used)
+                read = sector;
+            if (!used && previous_used)
+                write = sector-1;
+            previous_used = used;
+        }
+
+        if (!unused_seen) {
+            printf("ringfs_scan: invariant violated: no free sector found\r\n");
+            return -1;
+        }
+        if (!used_seen) {
+            write = first_free >= 0 ? first_free : 0;
+            read = write;
+        }
+
+        /* ERASED slots form a suffix of the write sector. */
+        write_.sector = write;
+        write_.slot = find_erased(write);
+        if (write_.slot >= slots_per_sector)
+            advance_sector(write_);
+
+        /* Skip discarded slots up to the first valid one. */
+        read_ = Loc{read, 0};
+        while (!(read_ == write_)) {
+            int end = read_.sector == write_.sector ? write_.slot : slots_per_sector;
+            skip_garbage(read_, end);
+            if (read_.slot >= slots_per_sector) {
+                advance_sector(read_);
+                continue;
+            }
+            if (read_ == write_ || slot_status(read_) == SLOT_VALID)
+                break;
+            advance_slot(read_);
+        }
+
+        cursor_ = read_;
+        return 0;
+    }
+
+    /** See ringfs_capacity(). */
+    static constexpr int capacity()
+    {
+        return slots_per_sector * (sector_count - 1);
+    }
+
+    /** See ringfs_count_estimate(). */
+    int count_estimate() const
+    {
+        return offset(write_);
+    }
+
+    /** See ringfs_count_exact(). */
+    int count_exact()
+    {
+        int count = 0;
+        for (Loc loc = read_; !(loc == write_); advance_slot(loc))
+            if (slot_status(loc) == SLOT_VALID)
+                count++;
+        return count;
+    }
+
+    /** See ringfs_append(). */
+    int append(const Object &object)
+    {
+        /* The next sector must be free; move the heads out of its way. */
+        int next = next_sector(write_.sector);
+        uint32_t status = sector_status(next);
+        if (status != SECTOR_FREE) {
+            if (read_.sector == next)
+                advance_sector(read_);
+            if (cursor_.sector == next)
+                advance_sector(cursor_);
+            if (!in_ring(cursor_))
+                cursor_ = read_;
+            sector_free(next);
+        }
+
+        /* Then the write sector must be writable. */
+        status = sector_status(write_.sector);
+        if (status == SECTOR_ERASING || status == SECTOR_ERASED) {
+            sector_free(write_.sector);
+            status = SECTOR_FREE;
+        }
+        if (status == SECTOR_FREE) {
+            set_sector_status(write_.sector, SECTOR_IN_USE);
+        } else if (status != SECTOR_IN_USE) {
+            printf("ringfs_append: corrupted filesystem\r\n");
+            return -1;
+        }
+
+        set_slot_status(write_, SLOT_RESERVED);
+        flash_.program(slot_address(write_) + slot_header_size, &object, sizeof(Object));
+        set_slot_status(write_, SLOT_VALID);
+
+        advance_slot(write_);
+        return 0;
+    }
+
+    /** See ringfs_fetch(). */
+    int fetch(Object &object)
+    {
+        while (!(cursor_ == write_)) {
+            bool valid = (slot_status(cursor_) == SLOT_VALID);
+            if (valid)
+                flash_.read(slot_address(cursor_) + slot_header_size, &object, sizeof(Object));
+            advance_slot(cursor_);
+            if (valid)
+                return 0;
+        }
+        return -1;
+    }
+
+    /** See ringfs_discard(). */
+    int discard()
+    {
+        if (read_.sector != cursor_.sector) {
+            /* An IN_USE sector must always be left for scan() to go by. */
+            if (cursor_.sector == write_.sector) {
+                uint32_t status = sector_status(write_.sector);
+                if (status == SECTOR_ERASING || status == SECTOR_ERASED) {
+                    sector_free(write_.sector);
+                    status = SECTOR_FREE;
+                }
+                if (status == SECTOR_FREE)
+                    set_sector_status(write_.sector, SECTOR_IN_USE);
+            }
+
+            /* Retire whole sectors, to be erased once the write head gets there. */
+            while (read_.sector != cursor_.sector) {
+                set_sector_status(read_.sector, SECTOR_ERASING);
+                advance_sector(read_);
+            }
+        }
+
+        while (!(read_ == cursor_)) {
+            set_slot_status(read_, SLOT_GARBAGE);
+            advance_slot(read_);
+        }
+        return 0;
+    }
+
+    /** See ringfs_rewind(). */
+    int rewind()
+    {
+        cursor_ = read_;
+        return 0;
+    }
+
+private:
+    enum : uint32_t {
+        SECTOR_ERASED     = 0xFFFFFFFF,
+        SECTOR_FREE       = 0xFFFFFF00,
+        SECTOR_IN_USE     = 0xFFFF0000,
+        SECTOR_ERASING    = 0xFF000000,
+        SECTOR_FORMATTING = 0x00000000,
+    };
+
+    enum : uint32_t {
+        SLOT_ERASED   = 0xFFFFFFFF,
+        SLOT_RESERVED = 0xFFFFFF00,
+        SLOT_VALID    = 0xFFFF0000,
+        SLOT_GARBAGE  = 0xFF000000,
+    };
+
+    struct Loc {
+        int sector;
+        int slot;
+        bool operator==(const Loc &other) const
+        {
+            return sector == other.sector && slot == other.slot;
+        }
+    };
+
+    /* Same layout as ringfs.c: status and version, then status and object. */
+    static constexpr int sector_count = Geometry::sector_count;
+    static constexpr int sector_header_size = 2 * sizeof(uint32_t);
+    static constexpr int slot_header_size = sizeof(uint32_t);
+    static constexpr int slot_size = slot_header_size + sizeof(Object);
+    static constexpr int slots_per_sector = (Geometry::sector_size - sector_header_size) / slot_size;
+    static_assert(slots_per_sector > 0, "sectors must hold at least one object");
+    static_assert(sector_count >= 2, "partitions need at least two sectors");
+
+    static constexpr bool sector_count_pow2 = (sector_count & (sector_count - 1)) == 0;
+
+    static constexpr int sector_address(int sector)
+    {
+        return (Geometry::sector_offset + sector) * Geometry::sector_size;
+    }
+
+    static constexpr int slot_address(const Loc &loc)
+    {
+        return sector_address(loc.sector) + sector_header_size + loc.slot * slot_size;
+    }
+
+    static constexpr int next_sector(int sector)
+    {
+        return sector_count_pow2 ? (sector + 1) & (sector_count - 1) :
+               sector + 1 == sector_count ? 0 : sector + 1;
+    }
+
+    /** Sectors from one to another, going forward around the ring. */
+    static constexpr int sector_distance(int from, int to)
+    {
+        return sector_count_pow2 ? (to - from) & (sector_count - 1) :
+               to >= from ? to - from : to - from + sector_count;
+    }
+
+    static void advance_sector(Loc &loc)
+    {
+        loc.slot = 0;
+        loc.sector = next_sector(loc.sector);
+    }
+
+    static void advance_slot(Loc &loc)
+    {
+        if (++loc.slot >= slots_per_sector)
+            advance_sector(loc);
+    }
+
+    int offset(const Loc &loc) const
+    {
+        return sector_distance(read_.sector, loc.sector) * slots_per_sector + loc.slot - read_.slot;
+    }
+
+    bool in_ring(const Loc &loc) const
+    {
+        int loc_offset = offset(loc);
+        return loc_offset >= 0 && loc_offset <= offset(write_);
+    }
+
+    uint32_t sector_status(int sector)
+    {
+        uint32_t status;
+        flash_.read(sector_address(sector), &status, sizeof(status));
+        return status;
+    }
+
+    void set_sector_status(int sector, uint32_t status)
+    {
+        flash_.program(sector_address(sector), &status, sizeof(status));
+    }
+
+    void sector_free(int sector)
+    {
+        set_sector_status(sector, SECTOR_ERASING);
+        flash_.sector_erase(sector_address(sector));
+        flash_.program(sector_address(sector) + sizeof(uint32_t), &version_, sizeof(version_));
+        set_sector_status(sector, SECTOR_FREE);
+    }
+
+    uint32_t slot_status(const Loc &loc)
+    {
+        uint32_t status;
+        flash_.read(slot_address(loc), &status, sizeof(status));
+        return status;
+    }
+
+    void set_slot_status(const Loc &loc, uint32_t status)
+    {
+        flash_.program(slot_address(loc), &status, sizeof(status));
+    }
+
+    /** First ERASED slot of a sector, or slots_per_sector if it's full. */
+    int find_erased(int sector)
+    {
+        int lo = 0;
+        int hi = slots_per_sector;
+        while (lo < hi) {
+            Loc mid = { sector, lo + (hi - lo) / 2 };
+            if (slot_status(mid) == SLOT_ERASED)
+                hi = mid.slot;
+            else
+                lo = mid.slot + 1;
+        }
+        return lo;
+    }
+
+    /** Move over the GARBAGE slots before end; they're a prefix of the run. */
+    void skip_garbage(Loc &loc, int end)
+    {
+        int lo = loc.slot;
+        int hi = end;
+        if (lo >= hi)
+            return;
+        if (slot_status(Loc{loc.sector, hi - 1}) == SLOT_GARBAGE) {
+            loc.slot = hi;
+            return;
+        }
+        while (lo < hi) {
+            Loc mid = { loc.sector, lo + (hi - lo) / 2 };
+            if (slot_status(mid) == SLOT_GARBAGE)
+                lo = mid.slot + 1;
+            else
+                hi = mid.slot;
+        }
+        loc.slot = lo;
+    }
+
+    Flash &flash_;
+    uint32_t version_;
+    Loc read_ = { 0, 0 };
+    Loc write_ = { 0, 0 };
+    Loc cursor_ = { 0, 0 };
+};
+
+} // namespace ringfs_cpp
+
+/**
+ * @}
+ */
+
+#endif
+
+/* vim: set ts=4 sw=4 et: */
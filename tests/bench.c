@@ -0,0 +1,299 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Benchmarks of the main RingFS operations on the flash simulator, across a
+ * matrix of geometries. Prints one JSON object per line and operation, with
+ * throughput, latency percentiles and flash ops per operation, and the time
+ * the flash itself would take according to the simulator's timing model.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ringfs.h"
+#include "flashsim.h"
+
+/* Flash simulator, counting ops. */
+
+static struct flashsim *sim;
+static long reads, programs, erases;
+
+static int op_sector_erase(struct ringfs_flash_partition *flash, int address)
+{
+    (void) flash;
+    flashsim_sector_erase(sim, address);
+    erases++;
+    return 0;
+}
+
+static ssize_t op_program(struct ringfs_flash_partition *flash, int address, const void *data, size_t size)
+{
+    (void) flash;
+    flashsim_program(sim, address, data, size);
+    programs++;
+    return size;
+}
+
+static ssize_t op_read(struct ringfs_flash_partition *flash, int address, void *data, size_t size)
+{
+    (void) flash;
+    flashsim_read(sim, address, data, size);
+    reads++;
+    return size;
+}
+
+/*
+ * Flash time is modeled after a typical SPI NOR part on a 50 MHz bus: 256 byte
+ * pages, 0.7 ms page programs and 45 ms 4 KiB sector erases.
+ */
+static const struct flashsim_timing spi_nor = {
+    .op_ns = 1000,
+    .read_byte_ns = 160,
+    .program_byte_ns = 160,
+    .program_page_ns = 700000,
+    .page_size = 256,
+    .erase_ns = 45000000,
+};
+
+/* Latency samples and flash ops of the operation being measured. Only what
+ * happens between sample_start() and sample_stop() counts. */
+
+#define MAX_SAMPLES 65536
+
+static long samples[MAX_SAMPLES];
+static long flash_samples[MAX_SAMPLES];
+static int sample_count;
+static long total_ns;
+static uint64_t total_flash_ns;
+static uint64_t start_flash_ns;
+static long op_reads, op_programs, op_erases;
+static long start_reads, start_programs, start_erases;
+static struct timespec started;
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void bench_start(void)
+{
+    sample_count = 0;
+    total_ns = 0;
+    total_flash_ns = 0;
+    op_reads = 0;
+    op_programs = 0;
+    op_erases = 0;
+}
+
+static void sample_start(void)
+{
+    start_reads = reads;
+    start_programs = programs;
+    start_erases = erases;
+    start_flash_ns = flashsim_elapsed_ns(sim);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+}
+
+static void sample_stop(void)
+{
+    long ns = now_ns() - (started.tv_sec * 1000000000L + started.tv_nsec);
+    long flash_ns = flashsim_elapsed_ns(sim) - start_flash_ns;
+    op_reads += reads - start_reads;
+    op_programs += programs - start_programs;
+    op_erases += erases - start_erases;
+    total_ns += ns;
+    total_flash_ns += flash_ns;
+    if (sample_count < MAX_SAMPLES) {
+        samples[sample_count] = ns;
+        flash_samples[sample_count] = flash_ns;
+    }
+    sample_count++;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(const long *sorted, int p)
+{
+    int n = sample_count < MAX_SAMPLES ? sample_count : MAX_SAMPLES;
+    return sorted[(n - 1) * p / 100];
+}
+
+static void bench_report(const char *op, struct ringfs_flash_partition *flash, int object_size)
+{
+    if (sample_count == 0)
+        return;
+
+    int n = sample_count < MAX_SAMPLES ? sample_count : MAX_SAMPLES;
+    qsort(samples, n, sizeof(samples[0]), compare_long);
+    qsort(flash_samples, n, sizeof(flash_samples[0]), compare_long);
+
+    printf("{\"op\": \"%s\", \"sector_size\": %d, \"sector_count\": %d, \"object_size\": %d, "
+           "\"ops\": %d, \"ops_per_sec\": %.0f, \"p50_ns\": %ld, \"p99_ns\": %ld, "
+           "\"reads_per_op\": %.2f, \"programs_per_op\": %.2f, \"erases_per_op\": %.4f, "
+           "\"flash_ns_per_op\": %.0f, \"flash_p50_ns\": %ld, \"flash_p99_ns\": %ld}\n",
+            op, flash->sector_size, flash->sector_count, object_size,
+            sample_count, sample_count * 1e9 / (total_ns ? total_ns : 1),
+            percentile(samples, 50), percentile(samples, 99),
+            (double) op_reads / sample_count,
+            (double) op_programs / sample_count,
+            (double) op_erases / sample_count,
+            (double) total_flash_ns / sample_count,
+            percentile(flash_samples, 50), percentile(flash_samples, 99));
+}
+
+/* The operations. */
+
+#define SCAN_ROUNDS 32
+#define COUNT_ROUNDS 32
+#define DISCARD_BATCH 8
+
+static void bench_geometry(int sector_size, int sector_count, int object_size)
+{
+    struct ringfs_flash_partition flash = {
+        .sector_size = sector_size,
+        .sector_offset = 0,
+        .sector_count = sector_count,
+
+        .sector_erase = op_sector_erase,
+        .program = op_program,
+        .read = op_read,
+    };
+    sim = flashsim_open_ram(sector_size * sector_count, sector_size);
+    flashsim_set_timing(sim, &spi_nor);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, 0x42, object_size);
+    ringfs_format(&fs);
+    if (ringfs_capacity(&fs) <= 0) {
+        flashsim_close(sim);
+        return;
+    }
+
+    uint8_t *object = malloc(object_size);
+    memset(object, 0x5A, object_size);
+
+    /* Twice the capacity, so half of the appends overwrite old objects. */
+    bench_start();
+    for (int i=0; i<2*ringfs_capacity(&fs); i++) {
+        sample_start();
+        ringfs_append(&fs, object);
+        sample_stop();
+    }
+    bench_report("append", &flash, object_size);
+
+    bench_start();
+    for (int i=0; i<SCAN_ROUNDS; i++) {
+        struct ringfs newfs;
+        ringfs_init(&newfs, &flash, 0x42, object_size);
+        sample_start();
+        ringfs_scan(&newfs);
+        sample_stop();
+    }
+    bench_report("scan", &flash, object_size);
+
+    bench_start();
+    for (int i=0; i<COUNT_ROUNDS; i++) {
+        sample_start();
+        ringfs_count_exact(&fs);
+        sample_stop();
+    }
+    bench_report("count_exact", &flash, object_size);
+
+    bench_start();
+    for (;;) {
+        sample_start();
+        int result = ringfs_fetch(&fs, object);
+        sample_stop();
+        if (result != 0)
+            break;
+    }
+    bench_report("fetch", &flash, object_size);
+
+    /* Both again, with a read cache of one sector. */
+    uint8_t *cache = malloc(sector_size);
+    ringfs_set_read_cache(&fs, cache, sector_size, sector_size);
+
+    bench_start();
+    for (int i=0; i<COUNT_ROUNDS; i++) {
+        sample_start();
+        ringfs_count_exact(&fs);
+        sample_stop();
+    }
+    bench_report("count_exact_cached", &flash, object_size);
+
+    ringfs_rewind(&fs);
+    bench_start();
+    for (;;) {
+        sample_start();
+        int result = ringfs_fetch(&fs, object);
+        sample_stop();
+        if (result != 0)
+            break;
+    }
+    bench_report("fetch_cached", &flash, object_size);
+
+    ringfs_set_read_cache(&fs, NULL, 0, 0);
+    free(cache);
+
+    /* Discard what was fetched a few objects at a time. */
+    ringfs_rewind(&fs);
+    bench_start();
+    for (;;) {
+        int fetched = 0;
+        while (fetched < DISCARD_BATCH && ringfs_fetch(&fs, object) == 0)
+            fetched++;
+        if (fetched == 0)
+            break;
+        sample_start();
+        ringfs_discard(&fs);
+        sample_stop();
+    }
+    bench_report("discard", &flash, object_size);
+
+    /* Appends again, with programs coalesced per flash page. */
+    uint8_t page[256];
+    struct ringfs_coalesce coalesce;
+    ringfs_coalesce_init(&coalesce, &flash, page, sizeof(page));
+    ringfs_init(&fs, &coalesce.flash, 0x42, object_size);
+    ringfs_format(&fs);
+    bench_start();
+    for (int i=0; i<2*ringfs_capacity(&fs); i++) {
+        sample_start();
+        ringfs_append(&fs, object);
+        sample_stop();
+    }
+    bench_report("append_coalesced", &flash, object_size);
+
+    free(object);
+    flashsim_close(sim);
+}
+
+int main(void)
+{
+    static const int sector_sizes[] = { 256, 1024, 4096 };
+    static const int sector_counts[] = { 4, 16, 64 };
+    static const int object_sizes[] = { 4, 32, 128 };
+
+    for (size_t i=0; i<sizeof(sector_sizes)/sizeof(*sector_sizes); i++)
+        for (size_t j=0; j<sizeof(sector_counts)/sizeof(*sector_counts); j++)
+            for (size_t k=0; k<sizeof(object_sizes)/sizeof(*object_sizes); k++)
+                bench_geometry(sector_sizes[i], sector_counts[j], object_sizes[k]);
+
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
@@ -13,6 +13,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
 
 #ifdef FLASHSIM_LOG
 #define logprintf(args...) printf(args)
@@ -24,15 +27,51 @@ struct flashsim {
     int size;
     int sector_size;
 
+    /* Either a stdio file, or memory: plain or mapped from a file. */
     FILE *fh;
+    uint8_t *data;
+    int fd;
+
+    struct flashsim_timing timing;
+    uint64_t elapsed_ns;
 };
 
+static void flashsim_init(struct flashsim *sim, int size, int sector_size)
+{
+    sim->size = size;
+    sim->sector_size = sector_size;
+    sim->fh = NULL;
+    sim->data = NULL;
+    sim->fd = -1;
+    memset(&sim->timing, 0, sizeof(sim->timing));
+    sim->elapsed_ns = 0;
+}
+
+/* Account for the time an operation takes. */
+static void flashsim_spend(struct flashsim *sim, uint64_t ns)
+{
+    sim->elapsed_ns += ns;
+    if (sim->timing.sleep && ns > 0) {
+        struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+void flashsim_set_timing(struct flashsim *sim, const struct flashsim_timing *timing)
+{
+    sim->timing = *timing;
+}
+
+uint64_t flashsim_elapsed_ns(struct flashsim *sim)
+{
+    return sim->elapsed_ns;
+}
+
 struct flashsim *flashsim_open(const char *name, int size, int sector_size)
 {
     struct flashsim *sim = malloc(sizeof(struct flashsim));
 
-    sim->size = size;
-    sim->sector_size = sector_size;
+    flashsim_init(sim, size, sector_size);
     sim->fh = fopen(name, "w+");
     assert(sim->fh != NULL);
     assert(ftruncate(fileno(sim->fh), size) == 0);
@@ -40,16 +79,74 @@ struct flashsim *flashsim_open(const char *name, int size, int sector_size)
     return sim;
 }
 
+struct flashsim *flashsim_open_ram(int size, int sector_size)
+{
+    struct flashsim *sim = malloc(sizeof(struct flashsim));
+
+    flashsim_init(sim, size, sector_size);
+    sim->data = calloc(1, size);
+    assert(sim->data != NULL);
+
+    return sim;
+}
+
+struct flashsim *flashsim_open_mmap(const char *name, int size, int sector_size)
+{
+    struct flashsim *sim = malloc(sizeof(struct flashsim));
+
+    flashsim_init(sim, size, sector_size);
+    sim->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(sim->fd >= 0);
+    assert(ftruncate(sim->fd, size) == 0);
+    sim->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sim->fd, 0);
+    assert(sim->data != MAP_FAILED);
+
+    return sim;
+}
+
 void flashsim_close(struct flashsim *sim)
 {
-    fclose(sim->fh);
+    if (sim->fh) {
+        fclose(sim->fh);
+    } else if (sim->fd >= 0) {
+        munmap(sim->data, sim->size);
+        close(sim->fd);
+    } else {
+        free(sim->data);
+    }
     free(sim);
 }
 
+/** AND data into memory, a word at a time where aligned. */
+static void flashsim_and(uint8_t *dest, const uint8_t *buf, int len)
+{
+    while (len > 0 && ((uintptr_t) dest % sizeof(uint64_t)) != 0) {
+        *dest++ &= *buf++;
+        len--;
+    }
+    for (; len >= (int) sizeof(uint64_t); len -= sizeof(uint64_t)) {
+        uint64_t word, bits;
+        memcpy(&word, dest, sizeof(word));
+        memcpy(&bits, buf, sizeof(bits));
+        word &= bits;
+        memcpy(dest, &word, sizeof(word));
+        dest += sizeof(uint64_t);
+        buf += sizeof(uint64_t);
+    }
+    while (len-- > 0)
+        *dest++ &= *buf++;
+}
+
 void flashsim_sector_erase(struct flashsim *sim, int addr)
 {
     int sector_start = addr - (addr % sim->sector_size);
     logprintf("flashsim_erase  (0x%08x) * erasing sector at 0x%08x\n", addr, sector_start);
+    flashsim_spend(sim, sim->timing.op_ns + sim->timing.erase_ns);
+
+    if (sim->data) {
+        memset(sim->data + sector_start, 0xff, sim->sector_size);
+        return;
+    }
 
     void *empty = malloc(sim->sector_size);
     memset(empty, 0xff, sim->sector_size);
@@ -62,8 +159,14 @@ void flashsim_sector_erase(struct flashsim *sim, int addr)
 
 void flashsim_read(struct flashsim *sim, int addr, uint8_t *buf, int len)
 {
-    assert(fseek(sim->fh, addr, SEEK_SET) == 0);
-    assert(fread(buf, 1, len, sim->fh) == (size_t) len);
+    assert(addr >= 0 && addr + len <= sim->size);
+    flashsim_spend(sim, sim->timing.op_ns + (uint64_t) len * sim->timing.read_byte_ns);
+    if (sim->data) {
+        memcpy(buf, sim->data + addr, len);
+    } else {
+        assert(fseek(sim->fh, addr, SEEK_SET) == 0);
+        assert(fread(buf, 1, len, sim->fh) == (size_t) len);
+    }
 
     logprintf("flashsim_read   (0x%08x) = %d bytes [ ", addr, len);
     for (int i=0; i<len; i++) {
@@ -88,6 +191,19 @@ void flashsim_program(struct flashsim *sim, int addr, const uint8_t *buf, int le
     }
     logprintf("]\n");
 
+    /* One page program per page touched. */
+    int pages = 1;
+    if (sim->timing.page_size > 0 && len > 0)
+        pages = (addr + len - 1) / sim->timing.page_size - addr / sim->timing.page_size + 1;
+    flashsim_spend(sim, (uint64_t) pages * (sim->timing.op_ns + sim->timing.program_page_ns) +
+            (uint64_t) len * sim->timing.program_byte_ns);
+
+    if (sim->data) {
+        assert(addr >= 0 && addr + len <= sim->size);
+        flashsim_and(sim->data + addr, buf, len);
+        return;
+    }
+
     uint8_t *data = malloc(len);
 
     assert(fseek(sim->fh, addr, SEEK_SET) == 0);
@@ -9,18 +9,48 @@
 #ifndef FLASHSIM_H
 #define FLASHSIM_H
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct flashsim;
 
+/*
+ * Timing model. Every read, program and erase is one transaction, except that
+ * programs are split at page boundaries like on real parts. Time adds up in
+ * flashsim_elapsed_ns(), and is slept for real if asked to.
+ */
+struct flashsim_timing {
+    int op_ns;              /* Per transaction: command, address, chip select. */
+    int read_byte_ns;
+    int program_byte_ns;
+    int program_page_ns;    /* Per page programmed, on top of the bytes. */
+    int page_size;          /* Zero for no page boundaries. */
+    int erase_ns;           /* Per sector. */
+    bool sleep;
+};
+
+/* Flash contents kept in a stdio file, in RAM, or in a memory-mapped file. */
 struct flashsim *flashsim_open(const char *name, int size, int sector_size);
+struct flashsim *flashsim_open_ram(int size, int sector_size);
+struct flashsim *flashsim_open_mmap(const char *name, int size, int sector_size);
 void flashsim_close(struct flashsim *sim);
 
 void flashsim_sector_erase(struct flashsim *sim, int addr);
 void flashsim_read(struct flashsim *sim, int addr, uint8_t *buf, int len);
 void flashsim_program(struct flashsim *sim, int addr, const uint8_t *buf, int len);
 
+void flashsim_set_timing(struct flashsim *sim, const struct flashsim_timing *timing);
+uint64_t flashsim_elapsed_ns(struct flashsim *sim);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
 
 /* vim: set ts=4 sw=4 et: */
@@ -4,7 +4,12 @@
 import random
 
 from pyflashsim import FlashSim
-from pyringfs import RingFSFlashPartition, RingFS
+from pyringfs import RingFSFlashPartition, RingFS, RINGFS_FEATURE_DISCARD_MARKS, RINGFS_FEATURE_VARIABLE, \
+        RINGFS_FEATURE_SEQUENCE, RINGFS_FEATURE_KEY_RANGE, RINGFS_FEATURE_ERASE_COUNT
+
+
+def key(obj):
+    return ord(obj[0]) if obj else 0
 
 
 def compare(a, b):
@@ -15,10 +20,10 @@ def compare(a, b):
 
 class FuzzRun(object):
 
-    def __init__(self, name, version, object_size, sector_size, total_sectors, sector_offset, sector_count):
+    def __init__(self, name, version, object_size, features, program_unit, sector_size, total_sectors, sector_offset, sector_count):
 
-        print "FuzzRun[%s]: v=%08x os=%d ss=%d ts=%d so=%d sc=%d" % (name, version, object_size, sector_size,
-                total_sectors, sector_offset, sector_count)
+        print "FuzzRun[%s]: v=%08x os=%d f=%x pu=%d ss=%d ts=%d so=%d sc=%d" % (name, version, object_size, features,
+                program_unit, sector_size, total_sectors, sector_offset, sector_count)
 
         sim = FlashSim(name, total_sectors*sector_size, sector_size)
 
@@ -27,6 +32,10 @@ class FuzzRun(object):
             return 0
 
         def op_program(flash, address, data):
+            # program units are programmed whole, and only once
+            if program_unit:
+                assert address % program_unit == 0 and len(data) % program_unit == 0
+                assert sim.read(address, len(data)) == '\xff' * len(data)
             sim.program(address, data)
             return len(data)
 
@@ -35,10 +44,18 @@ class FuzzRun(object):
 
         self.version = version
         self.object_size = object_size
+        self.features = features
+        self.program_unit = program_unit
 
         self.flash = RingFSFlashPartition(sector_size, sector_offset, sector_count,
                 op_sector_erase, op_program, op_read)
-        self.fs = RingFS(self.flash, self.version, self.object_size)
+        self.fs = RingFS(self.flash, self.version, self.object_size, self.features, self.program_unit)
+        self.fs.set_background_erase(random.randint(0, 1))
+        self.fs.set_reserve(random.randint(1, sector_count-1))
+        self.fs.set_key(key)
+        if random.random() < 0.5:
+            window = random.choice([d for d in xrange(1, sector_size+1) if sector_size % d == 0])
+            self.fs.set_read_cache(window * random.randint(1, 5), window)
 
     def run(self):
 
@@ -46,10 +63,25 @@ class FuzzRun(object):
         self.fs.dump()
 
         def do_append():
-            self.fs.append('x'*self.object_size)
+            # the first byte is the key
+            if self.features & RINGFS_FEATURE_VARIABLE:
+                size = random.randint(0, self.object_size)
+            else:
+                size = self.object_size
+            obj = ''.join(chr(random.randint(0, 255)) for i in xrange(size))
+            if self.features & RINGFS_FEATURE_VARIABLE:
+                self.fs.append_var(obj)
+            else:
+                self.fs.append(obj)
 
         def do_fetch():
-            self.fs.fetch()
+            if self.features & RINGFS_FEATURE_VARIABLE:
+                self.fs.fetch_var()
+            else:
+                self.fs.fetch()
+
+        def do_fetch_many():
+            self.fs.fetch_many(random.randint(1, 8))
 
         def do_rewind():
             self.fs.rewind()
@@ -57,19 +89,47 @@ class FuzzRun(object):
         def do_discard():
             self.fs.discard()
 
+        def do_poll():
+            self.fs.poll()
+
+        def do_seek():
+            if self.features & RINGFS_FEATURE_SEQUENCE:
+                self.fs.rewind()
+                first = self.fs.tell()
+                self.fs.seek(first + random.randint(0, self.fs.count_estimate()))
+
+        def do_fetch_range():
+            if self.features & RINGFS_FEATURE_KEY_RANGE:
+                lo = random.randint(0, 255)
+                hi = random.randint(lo, 255)
+                if random.randint(0, 1):
+                    self.fs.seek_key(lo)
+                obj = self.fs.fetch_range(lo, hi)
+                assert obj is None or lo <= key(obj) <= hi
+
         for i in xrange(1000):
-            fun = random.choice([do_append]*100 + [do_fetch]*100 + [do_rewind]*10 + [do_discard]*10)
+            fun = random.choice([do_append]*100 + [do_fetch]*100 + [do_fetch_many]*20 + [do_rewind]*10 + [do_discard]*10 + [do_poll]*10 + [do_seek]*10 + [do_fetch_range]*10)
             print i, fun.__name__
             fun()
 
             # consistency check
-            newfs = RingFS(self.flash, self.version, self.object_size)
+            newfs = RingFS(self.flash, self.version, self.object_size, self.features, self.program_unit)
             try:
                 assert newfs.scan() == 0
                 assert compare(newfs.ringfs.read.sector, self.fs.ringfs.read.sector)
                 assert compare(newfs.ringfs.read.slot, self.fs.ringfs.read.slot)
                 assert compare(newfs.ringfs.write.sector, self.fs.ringfs.write.sector)
                 assert compare(newfs.ringfs.write.slot, self.fs.ringfs.write.slot)
+                if self.features & RINGFS_FEATURE_ERASE_COUNT:
+                    wear = newfs.wear_report()
+                    assert wear is not None
+                    assert wear.min >= 1 and wear.max - wear.min <= 2
+                if self.features & RINGFS_FEATURE_SEQUENCE:
+                    cursor = self.fs.tell()
+                    self.fs.rewind()
+                    assert compare(newfs.tell(), self.fs.tell())
+                    assert self.fs.seek(cursor) == 0
+                    assert compare(self.fs.tell(), cursor)
             except AssertionError:
                 print "self.fs:"
                 self.fs.dump()
@@ -78,12 +138,47 @@ class FuzzRun(object):
                 raise
 
 
+def unit_round(size, unit):
+    return (size + unit - 1) // unit * unit
+
 sector_size = random.randint(16, 256)
+unit = 0
+if random.random() < 0.3:
+    unit = random.choice([8, 16])
+    sector_size = unit_round(sector_size, unit)
 total_sectors = random.randint(2, 8)
 sector_offset = random.randint(0, total_sectors-2)
 sector_count = random.randint(2, total_sectors-sector_offset)
 version = random.randint(0, 0xffffffff)
-object_size = random.randint(1, sector_size-8)
-
-f = FuzzRun('tests/fuzzer.sim', version, object_size, sector_size, total_sectors, sector_offset, sector_count)
+features = 0
+if sector_size > 24 and random.random() < 0.5:
+    features |= RINGFS_FEATURE_VARIABLE
+if sector_size > 40 and random.random() < 0.5:
+    features |= RINGFS_FEATURE_DISCARD_MARKS
+if sector_size > 40 and not features & RINGFS_FEATURE_VARIABLE and random.random() < 0.5:
+    features |= RINGFS_FEATURE_SEQUENCE
+if sector_size > 64 and random.random() < 0.5:
+    features |= RINGFS_FEATURE_KEY_RANGE
+if sector_size > 72 and random.random() < 0.5:
+    features |= RINGFS_FEATURE_ERASE_COUNT
+# sector header, then at least one slot or record header and padding
+overhead = 8 + (16 if features & RINGFS_FEATURE_DISCARD_MARKS else 0) + \
+        (8 if features & RINGFS_FEATURE_SEQUENCE else 0) + \
+        (12 if features & RINGFS_FEATURE_KEY_RANGE else 0) + \
+        (8 if features & RINGFS_FEATURE_ERASE_COUNT else 0) + \
+        (8 + 3 if features & RINGFS_FEATURE_VARIABLE else 4)
+object_size = random.randint(1, sector_size-overhead)
+
+# with a program unit, statuses take a unit per state and fields are padded
+program_unit = 0
+if unit and not features & RINGFS_FEATURE_VARIABLE:
+    header = 4*unit + unit + (4*unit if features & RINGFS_FEATURE_DISCARD_MARKS else 0) + \
+            (unit_round(8, unit) if features & RINGFS_FEATURE_SEQUENCE else 0) + \
+            (unit_round(12, unit) if features & RINGFS_FEATURE_KEY_RANGE else 0) + \
+            (unit_round(8, unit) if features & RINGFS_FEATURE_ERASE_COUNT else 0)
+    if sector_size - header - 3*unit >= unit:
+        program_unit = unit
+        object_size = random.randint(1, sector_size - header - 3*unit)
+
+f = FuzzRun('tests/fuzzer.sim', version, object_size, features, program_unit, sector_size, total_sectors, sector_offset, sector_count)
 f.run()
@@ -0,0 +1,194 @@
+/*
+ * Copyright © 2014 Kosma Moczek <kosma@cloudyourcar.com>
+ * This program is free software. It comes without any warranty, to the extent
+ * permitted by applicable law. You can redistribute it and/or modify it under
+ * the terms of the Do What The Fuck You Want To Public License, Version 2, as
+ * published by Sam Hocevar. See the COPYING file for more details.
+ */
+
+/*
+ * Interoperability tests of the C++ front-end: partitions written by one side
+ * have to mount and read back the same on the other.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ringfs.hpp"
+#include "ringfs.h"
+#include "flashsim.h"
+
+#define check(expr) do { \
+        if (!(expr)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #expr); \
+            exit(1); \
+        } \
+    } while (0)
+
+/* Flash simulator, for both sides. */
+
+static struct flashsim *sim;
+
+struct SimFlash {
+    int sector_erase(int address)
+    {
+        flashsim_sector_erase(sim, address);
+        return 0;
+    }
+
+    ssize_t program(int address, const void *data, size_t size)
+    {
+        flashsim_program(sim, address, (const uint8_t *) data, size);
+        return size;
+    }
+
+    ssize_t read(int address, void *data, size_t size)
+    {
+        flashsim_read(sim, address, (uint8_t *) data, size);
+        return size;
+    }
+};
+
+static int op_sector_erase(struct ringfs_flash_partition *, int address)
+{
+    flashsim_sector_erase(sim, address);
+    return 0;
+}
+
+static ssize_t op_program(struct ringfs_flash_partition *, int address, const void *data, size_t size)
+{
+    flashsim_program(sim, address, (const uint8_t *) data, size);
+    return size;
+}
+
+static ssize_t op_read(struct ringfs_flash_partition *, int address, void *data, size_t size)
+{
+    flashsim_read(sim, address, (uint8_t *) data, size);
+    return size;
+}
+
+struct Object {
+    uint32_t index;
+    uint8_t payload[10];
+};
+
+static Object make_object(uint32_t index)
+{
+    Object object;
+    object.index = index;
+    for (size_t i=0; i<sizeof(object.payload); i++)
+        object.payload[i] = (uint8_t) (index + i);
+    return object;
+}
+
+static void check_object(const Object &object, uint32_t index)
+{
+    Object expected = make_object(index);
+    check(memcmp(&object, &expected, sizeof(object)) == 0);
+}
+
+template <typename Geometry>
+static void test_interop(const char *name)
+{
+    printf("# test_interop %s\n", name);
+
+    struct ringfs_flash_partition flash = {};
+    flash.sector_size = Geometry::sector_size;
+    flash.sector_offset = Geometry::sector_offset;
+    flash.sector_count = Geometry::sector_count;
+    flash.sector_erase = op_sector_erase;
+    flash.program = op_program;
+    flash.read = op_read;
+
+    sim = flashsim_open_ram((Geometry::sector_offset + Geometry::sector_count) * Geometry::sector_size,
+            Geometry::sector_size);
+
+    SimFlash simflash;
+    typedef ringfs_cpp::Ring<Object, Geometry, SimFlash> Ring;
+    Ring ring(simflash, 0x42);
+    struct ringfs fs;
+    Object object;
+
+    /* C++ writes past the capacity, C reads what's left. */
+    ring.format();
+    int total = Ring::capacity() + Ring::capacity() / 2 + 3;
+    for (int i=0; i<total; i++)
+        check(ring.append(make_object(i)) == 0);
+    check(ring.count_exact() == ring.count_estimate());
+
+    ringfs_init(&fs, &flash, 0x42, sizeof(Object));
+    check(ringfs_scan(&fs) == 0);
+    check(ringfs_capacity(&fs) == Ring::capacity());
+    check(ringfs_count_exact(&fs) == ring.count_exact());
+    check(ringfs_count_estimate(&fs) == ring.count_estimate());
+    uint32_t first = total - ringfs_count_exact(&fs);
+    for (int i=0; i<ringfs_count_exact(&fs); i++) {
+        check(ringfs_fetch(&fs, &object) == 0);
+        check_object(object, first + i);
+    }
+    check(ringfs_fetch(&fs, &object) == -1);
+
+    /* C discards part of it, C++ picks up from there and appends more. */
+    ringfs_rewind(&fs);
+    int discarded = Ring::capacity() / 2 + 1;
+    for (int i=0; i<discarded; i++)
+        check(ringfs_fetch(&fs, &object) == 0);
+    check(ringfs_discard(&fs) == 0);
+    check(ringfs_item_discard(&fs) == 0);
+    discarded++;
+
+    check(ring.scan() == 0);
+    check(ring.count_exact() == ringfs_count_exact(&fs));
+    check(ring.count_estimate() == ringfs_count_estimate(&fs));
+    for (int i=0; i<ring.count_exact(); i++) {
+        check(ring.fetch(object) == 0);
+        check_object(object, first + discarded + i);
+    }
+    check(ring.fetch(object) == -1);
+
+    for (int i=0; i<Ring::capacity(); i++)
+        check(ring.append(make_object(total + i)) == 0);
+    total += Ring::capacity();
+
+    /* C++ discards, C sees the same ring. */
+    ring.rewind();
+    for (int i=0; i<3; i++)
+        check(ring.fetch(object) == 0);
+    check(ring.discard() == 0);
+
+    check(ringfs_scan(&fs) == 0);
+    check(ringfs_count_exact(&fs) == ring.count_exact());
+    check(ringfs_count_estimate(&fs) == ring.count_estimate());
+    first = total - ringfs_count_exact(&fs);
+    for (int i=0; i<ringfs_count_exact(&fs); i++) {
+        check(ringfs_fetch(&fs, &object) == 0);
+        check_object(object, first + i);
+    }
+
+    /* Everything gone, on both sides. */
+    check(ringfs_discard(&fs) == 0);
+    check(ring.scan() == 0);
+    check(ring.count_exact() == 0);
+    check(ring.fetch(object) == -1);
+    check(ring.append(make_object(total)) == 0);
+    check(ringfs_scan(&fs) == 0);
+    check(ringfs_fetch(&fs, &object) == 0);
+    check_object(object, total);
+
+    /* Partitions of another version don't mount. */
+    Ring other(simflash, 0x43);
+    check(other.scan() == -1);
+
+    flashsim_close(sim);
+}
+
+int main()
+{
+    test_interop<ringfs_cpp::Geometry<256, 2, 8> >("power of two");
+    test_interop<ringfs_cpp::Geometry<96, 0, 5> >("odd");
+    printf("# interop: ok\n");
+    return 0;
+}
+
+/* vim: set ts=4 sw=4 et: */
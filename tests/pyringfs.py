@@ -14,6 +14,7 @@ class StructRingFSFlashPartition(Structure):
 op_sector_erase_t = CFUNCTYPE(c_int, POINTER(StructRingFSFlashPartition), c_int)
 op_program_t = CFUNCTYPE(c_ssize_t, POINTER(StructRingFSFlashPartition), c_int, c_void_p, c_size_t)
 op_read_t = CFUNCTYPE(c_ssize_t, POINTER(StructRingFSFlashPartition), c_int, c_void_p, c_size_t)
+key_t = CFUNCTYPE(c_uint32, c_void_p, c_int)
 
 StructRingFSFlashPartition._fields_ = [
     ('sector_size', c_int),
@@ -23,6 +24,10 @@ StructRingFSFlashPartition._fields_ = [
     ('sector_erase', op_sector_erase_t),
     ('program', op_program_t),
     ('read', op_read_t),
+    ('map', c_void_p),
+    ('sector_erase_start', c_void_p),
+    ('busy', c_void_p),
+    ('sync', c_void_p),
 ]
 
 class StructRingFSLoc(Structure):
@@ -31,16 +36,70 @@ class StructRingFSLoc(Structure):
         ('slot', c_int),
     ]
 
+
+RINGFS_FEATURE_DISCARD_MARKS = 1 << 0
+RINGFS_FEATURE_VARIABLE = 1 << 1
+RINGFS_FEATURE_SEQUENCE = 1 << 2
+RINGFS_FEATURE_KEY_RANGE = 1 << 3
+RINGFS_FEATURE_ERASE_COUNT = 1 << 4
+
+
+class StructRingFSWear(Structure):
+    _fields_ = [
+        ('min', c_uint32),
+        ('max', c_uint32),
+        ('mean', c_uint32),
+        ('sectors', c_int),
+    ]
+
+
 class StructRingFS(Structure):
     _fields_ = [
         ('flash', POINTER(StructRingFSFlashPartition)),
         ('version', c_uint32),
         ('object_size', c_int),
+        ('features', c_uint32),
+        ('program_unit', c_int),
         ('slots_per_sector', c_int),
+        ('sector_header_size', c_int),
+        ('slot_header_size', c_int),
+        ('slot_size', c_int),
 
         ('read', StructRingFSLoc),
         ('write', StructRingFSLoc),
         ('cursor', StructRingFSLoc),
+        ('read_marks', c_int),
+        ('sequence_sector', c_int),
+        ('sequence', c_uint32),
+        ('key', key_t),
+        ('key_sector', c_int),
+        ('key_min', c_uint32),
+        ('key_max', c_uint32),
+        ('write_next', c_uint32),
+        ('write_reserved', c_uint32),
+        ('write_committed', c_uint32),
+        ('write_failed', c_int),
+
+        ('sectors', c_void_p),
+        ('cache', c_void_p),
+        ('cache_window', c_int),
+        ('cache_windows', c_int),
+        ('cache_next', c_int),
+        ('cache_address', c_int * 4),
+        ('cursor_valid', c_int),
+        ('cursor_used', c_int),
+
+        ('checkpoint', POINTER(StructRingFSFlashPartition)),
+        ('checkpoint_next', c_int),
+        ('checkpoint_read', c_int),
+        ('checkpoint_write', c_int),
+
+        ('consumers', c_void_p),
+
+        ('background_erase', c_int),
+        ('erasing', c_int),
+        ('erasing_count', c_uint32),
+        ('reserve', c_int),
     ]
 
 
@@ -48,15 +107,29 @@ class libringfs(GenericLibrary):
     dllname = './ringfs.so'
     functions = [
         ['ringfs_init', [POINTER(StructRingFS), POINTER(StructRingFSFlashPartition), c_uint32, c_int], c_int],
+        ['ringfs_set_features', [POINTER(StructRingFS), c_uint32], c_int],
+        ['ringfs_set_background_erase', [POINTER(StructRingFS), c_int], c_int],
+        ['ringfs_set_reserve', [POINTER(StructRingFS), c_int], c_int],
+        ['ringfs_set_key', [POINTER(StructRingFS), key_t], c_int],
         ['ringfs_format', [POINTER(StructRingFS)], c_int],
         ['ringfs_scan', [POINTER(StructRingFS)], c_int],
         ['ringfs_capacity', [POINTER(StructRingFS)], c_int],
         ['ringfs_count_estimate', [POINTER(StructRingFS)], c_int],
         ['ringfs_count_exact', [POINTER(StructRingFS)], c_int],
+        ['ringfs_poll', [POINTER(StructRingFS)], c_int],
         ['ringfs_append', [POINTER(StructRingFS), c_void_p], c_int],
+        ['ringfs_append_batch', [POINTER(StructRingFS), c_void_p, c_int], c_int],
+        ['ringfs_append_var', [POINTER(StructRingFS), c_void_p, c_int], c_int],
         ['ringfs_fetch', [POINTER(StructRingFS), c_void_p], c_int],
+        ['ringfs_fetch_var', [POINTER(StructRingFS), c_void_p, POINTER(c_int)], c_int],
+        ['ringfs_fetch_many', [POINTER(StructRingFS), c_void_p, c_int, POINTER(c_int)], c_int],
         ['ringfs_discard', [POINTER(StructRingFS)], c_int],
         ['ringfs_rewind', [POINTER(StructRingFS)], c_int],
+        ['ringfs_tell', [POINTER(StructRingFS), POINTER(c_uint32)], c_int],
+        ['ringfs_seek', [POINTER(StructRingFS), c_uint32], c_int],
+        ['ringfs_seek_key', [POINTER(StructRingFS), c_uint32], c_int],
+        ['ringfs_fetch_range', [POINTER(StructRingFS), c_uint32, c_uint32, c_void_p, POINTER(c_int)], c_int],
+        ['ringfs_wear_report', [POINTER(StructRingFS), POINTER(StructRingFSWear)], c_int],
         ['ringfs_dump', [c_void_p, POINTER(StructRingFS)], None],
     ]
 
@@ -86,13 +159,36 @@ class RingFSFlashPartition(object):
 
 class RingFS(object):
 
-    def __init__(self, flash, version, object_size):
+    def __init__(self, flash, version, object_size, features=0, program_unit=0):
         self.libringfs = libringfs()
         self.ringfs = StructRingFS()
         self.flash = flash.struct
         self.libringfs.ringfs_init(byref(self.ringfs), byref(self.flash), version, object_size)
+        self.libringfs.ringfs_set_features(byref(self.ringfs), features)
+        self.libringfs.ringfs_set_program_unit(byref(self.ringfs), program_unit)
         self.object_size = object_size
 
+    def set_background_erase(self, enable):
+        self.libringfs.ringfs_set_background_erase(byref(self.ringfs), enable)
+
+    def set_reserve(self, sectors):
+        return self.libringfs.ringfs_set_reserve(byref(self.ringfs), sectors)
+
+    def set_key(self, key):
+        def op_key(obj, size):
+            return key(string_at(obj, size))
+        # keep a reference, or the callback gets garbage collected
+        self.key = key_t(op_key)
+        self.libringfs.ringfs_set_key(byref(self.ringfs), self.key)
+
+    def set_read_cache(self, size, window):
+        # keep a reference, the cache lives as long as the instance
+        self.cache = create_string_buffer(size)
+        return self.libringfs.ringfs_set_read_cache(byref(self.ringfs), self.cache, size, window)
+
+    def poll(self):
+        return self.libringfs.ringfs_poll(byref(self.ringfs))
+
     def format(self):
         self.libringfs.ringfs_format(byref(self.ringfs))
 
@@ -111,17 +207,56 @@ class RingFS(object):
     def append(self, obj):
         self.libringfs.ringfs_append(byref(self.ringfs), obj)
 
+    def append_var(self, obj):
+        self.libringfs.ringfs_append_var(byref(self.ringfs), obj, len(obj))
+
     def fetch(self):
         obj = create_string_buffer(self.object_size)
-        self.libringfs.ringfs_append(byref(self.ringfs), obj)
+        self.libringfs.ringfs_fetch(byref(self.ringfs), obj)
         return obj.raw
 
+    def fetch_var(self):
+        obj = create_string_buffer(self.object_size)
+        size = c_int()
+        self.libringfs.ringfs_fetch_var(byref(self.ringfs), obj, byref(size))
+        return obj.raw[:size.value]
+
+    def fetch_many(self, max):
+        objs = create_string_buffer(self.object_size * max)
+        fetched = c_int()
+        self.libringfs.ringfs_fetch_many(byref(self.ringfs), objs, max, byref(fetched))
+        return [objs.raw[i*self.object_size:(i+1)*self.object_size] for i in xrange(fetched.value)]
+
     def discard(self):
         self.libringfs.ringfs_discard(byref(self.ringfs))
 
     def rewind(self):
         self.libringfs.ringfs_rewind(byref(self.ringfs))
 
+    def tell(self):
+        sequence = c_uint32()
+        self.libringfs.ringfs_tell(byref(self.ringfs), byref(sequence))
+        return sequence.value
+
+    def seek(self, sequence):
+        return self.libringfs.ringfs_seek(byref(self.ringfs), sequence)
+
+    def seek_key(self, key):
+        return self.libringfs.ringfs_seek_key(byref(self.ringfs), key)
+
+    def fetch_range(self, min, max):
+        obj = create_string_buffer(self.object_size)
+        size = c_int()
+        if self.libringfs.ringfs_fetch_range(byref(self.ringfs), min, max, obj, byref(size)) != 0:
+            return None
+        return obj.raw[:size.value]
+
+    def wear_report(self):
+        wear = StructRingFSWear()
+        if self.libringfs.ringfs_wear_report(byref(self.ringfs), byref(wear)) != 0:
+            return None
+        return wear
+
     def dump(self):
         import ctypes
         ctypes.pythonapi.PyFile_AsFile.argtypes= [ ctypes.py_object ]
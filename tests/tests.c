@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
 #include <check.h>
 
 #include "ringfs.h"
@@ -19,11 +20,8 @@
 
 /* Flashsim tests. */
 
-START_TEST(test_flashsim)
+static void assert_flashsim(struct flashsim *smallsim)
 {
-    printf("# test_flashsim\n");
-
-    struct flashsim *smallsim = flashsim_open("tests/test.sim", 1024, 16);
     uint8_t buf[48];
     uint8_t data[16];
 
@@ -56,18 +54,89 @@ START_TEST(test_flashsim)
     for (int i=32; i<48; i++)
         ck_assert_int_eq(buf[i], 0x10);
 
-    free(smallsim);
+    /* Programs only clear bits, unaligned ones included. */
+    memset(data, 0xf0, 16);
+    flashsim_program(smallsim, 19, data, 11);
+    memset(data, 0x3c, 16);
+    flashsim_program(smallsim, 17, data, 14);
+    flashsim_read(smallsim, 16, buf, 16);
+    for (int i=0; i<16; i++) {
+        uint8_t expected = 0xff;
+        if (i >= 3 && i < 14)
+            expected &= 0xf0;
+        if (i >= 1 && i < 15)
+            expected &= 0x3c;
+        ck_assert_int_eq(buf[i], expected);
+    }
+}
+
+START_TEST(test_flashsim)
+{
+    printf("# test_flashsim\n");
+
+    struct flashsim *smallsim = flashsim_open("tests/test.sim", 1024, 16);
+    assert_flashsim(smallsim);
+    flashsim_close(smallsim);
+
+    printf("## in RAM\n");
+    smallsim = flashsim_open_ram(1024, 16);
+    assert_flashsim(smallsim);
+    flashsim_close(smallsim);
+
+    printf("## memory-mapped\n");
+    smallsim = flashsim_open_mmap("tests/test.sim", 1024, 16);
+    assert_flashsim(smallsim);
+    flashsim_close(smallsim);
+}
+END_TEST
+
+START_TEST(test_flashsim_timing)
+{
+    printf("# test_flashsim_timing\n");
+
+    struct flashsim *smallsim = flashsim_open_ram(1024, 256);
+    struct flashsim_timing timing = {
+        .op_ns = 1000,
+        .read_byte_ns = 10,
+        .program_byte_ns = 20,
+        .program_page_ns = 500,
+        .page_size = 16,
+        .erase_ns = 100000,
+    };
+    uint8_t data[32];
+    memset(data, 0, sizeof(data));
+
+    ck_assert_int_eq(flashsim_elapsed_ns(smallsim), 0);
+    flashsim_set_timing(smallsim, &timing);
+
+    flashsim_sector_erase(smallsim, 0);
+    ck_assert_int_eq(flashsim_elapsed_ns(smallsim), 101000);
+    flashsim_read(smallsim, 0, data, 32);
+    ck_assert_int_eq(flashsim_elapsed_ns(smallsim), 101000 + 1320);
+
+    printf("## programs are split at page boundaries\n");
+    flashsim_program(smallsim, 0, data, 16);
+    ck_assert_int_eq(flashsim_elapsed_ns(smallsim), 102320 + 1500 + 320);
+    flashsim_program(smallsim, 24, data, 16);
+    ck_assert_int_eq(flashsim_elapsed_ns(smallsim), 104140 + 2*1500 + 320);
+
+    flashsim_close(smallsim);
 }
 END_TEST
 
 /* Flash simulator + MTD partition fixture. */
 
 static struct flashsim *sim;
+static int program_calls;
+static int read_calls;
+
+static int erase_calls;
 
 static int op_sector_erase(struct ringfs_flash_partition *flash, int address)
 {
     (void) flash;
     flashsim_sector_erase(sim, address);
+    erase_calls++;
     return 0;
 }
 
@@ -75,6 +144,7 @@ static ssize_t op_program(struct ringfs_flash_partition *flash, int address, con
 {
     (void) flash;
     flashsim_program(sim, address, data, size);
+    program_calls++;
     return size;
 }
 
@@ -82,9 +152,54 @@ static ssize_t op_read(struct ringfs_flash_partition *flash, int address, void *
 {
     (void) flash;
     flashsim_read(sim, address, data, size);
+    read_calls++;
     return size;
 }
 
+static uint8_t mapped[1024];
+static int map_calls;
+
+static const void *op_map(struct ringfs_flash_partition *flash, int address, size_t size)
+{
+    (void) flash;
+    /* Reads from here don't count as flash reads. */
+    flashsim_read(sim, address, mapped + address, size);
+    map_calls++;
+    return mapped + address;
+}
+
+/* Background erases take a few busy polls to complete. */
+static int erase_pending = -1;
+static int erase_busy;
+static int erase_start_calls;
+
+static int op_sector_erase_start(struct ringfs_flash_partition *flash, int address)
+{
+    (void) flash;
+    ck_assert_int_eq(erase_pending, -1);
+    erase_pending = address;
+    erase_busy = 3;
+    erase_start_calls++;
+    return 0;
+}
+
+static int op_busy(struct ringfs_flash_partition *flash)
+{
+    (void) flash;
+    if (erase_pending >= 0 && --erase_busy == 0) {
+        flashsim_sector_erase(sim, erase_pending);
+        erase_pending = -1;
+    }
+    return erase_pending >= 0;
+}
+
+/* Nothing gets programmed to a sector while it's being erased. */
+static ssize_t op_program_idle(struct ringfs_flash_partition *flash, int address, const void *data, size_t size)
+{
+    ck_assert(erase_pending < 0 || address / flash->sector_size != erase_pending / flash->sector_size);
+    return op_program(flash, address, data, size);
+}
+
 /*
  * A really small filesystem: 3 slots per sector, 15 slots total.
  * Has the benefit of causing frequent wraparounds, potentially finding
@@ -102,7 +217,7 @@ static struct ringfs_flash_partition flash = {
 
 static void fixture_flashsim_setup(void)
 {
-    sim = flashsim_open("tests/ringfs.sim",
+    sim = flashsim_open_mmap("tests/ringfs.sim",
             flash.sector_size * (flash.sector_offset + flash.sector_count),
             flash.sector_size);
 }
@@ -113,6 +228,21 @@ static void fixture_flashsim_teardown(void)
     sim = NULL;
 }
 
+/* Tests with a geometry of their own swap in a simulator for it. */
+static struct flashsim *fixture_sim;
+
+static void sim_open_scratch(const char *name, int size, int sector_size)
+{
+    fixture_sim = sim;
+    sim = flashsim_open_mmap(name, size, sector_size);
+}
+
+static void sim_close_scratch(void)
+{
+    flashsim_close(sim);
+    sim = fixture_sim;
+}
+
 /* RingFS tests. */
 
 #define DEFAULT_VERSION 0x000000042
@@ -130,6 +260,8 @@ static void assert_scan_integrity(const struct ringfs *fs)
 {
     struct ringfs newfs;
     ringfs_init(&newfs, fs->flash, fs->version, fs->object_size);
+    ringfs_set_features(&newfs, fs->features);
+    ringfs_set_program_unit(&newfs, fs->program_unit);
     ck_assert(ringfs_scan(&newfs) == 0);
     ck_assert_int_eq(newfs.read.sector, fs->read.sector);
     ck_assert_int_eq(newfs.read.slot, fs->read.slot);
@@ -411,6 +543,1475 @@ START_TEST(test_ringfs_overflow)
 }
 END_TEST
 
+START_TEST(test_ringfs_append_batch)
+{
+    printf("# test_ringfs_append_batch\n");
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+
+    printf("## batch append within one sector\n");
+    int objects[32];
+    for (int i=0; i<32; i++)
+        objects[i] = 0x11*(i+1);
+    program_calls = 0;
+    ck_assert(ringfs_append_batch(&fs, objects, fs.slots_per_sector) == 0);
+    /* sector mark + one reserve and write + one commit */
+    ck_assert_int_eq(program_calls, 1 + 2);
+    assert_loc_equiv_to_offset(&fs, &fs.write, fs.slots_per_sector);
+    assert_scan_integrity(&fs);
+
+    printf("## batch append across sectors\n");
+    ck_assert(ringfs_append_batch(&fs, objects + fs.slots_per_sector, 7) == 0);
+    assert_loc_equiv_to_offset(&fs, &fs.write, fs.slots_per_sector + 7);
+    assert_scan_integrity(&fs);
+    ck_assert_int_eq(ringfs_count_exact(&fs), fs.slots_per_sector + 7);
+
+    int obj;
+    for (int i=0; i<fs.slots_per_sector + 7; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, objects[i]);
+    }
+    ck_assert(ringfs_fetch(&fs, &obj) < 0);
+
+    printf("## batch append wrapping around\n");
+    int capacity = ringfs_capacity(&fs);
+    for (int i=0; i<capacity; i+=8)
+        ck_assert(ringfs_append_batch(&fs, objects, capacity-i < 8 ? capacity-i : 8) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), ringfs_count_estimate(&fs));
+    assert_scan_integrity(&fs);
+
+    ck_assert(ringfs_append_batch(&fs, objects, 0) == 0);
+    ck_assert(ringfs_append_batch(&fs, objects, -1) < 0);
+}
+END_TEST
+
+START_TEST(test_ringfs_fetch_many)
+{
+    printf("# test_ringfs_fetch_many\n");
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+
+    int objects[16];
+    int fetched;
+    ck_assert(ringfs_fetch_many(&fs, objects, 16, &fetched) < 0);
+    ck_assert_int_eq(fetched, 0);
+
+    for (int i=0; i<10; i++)
+        ringfs_append(&fs, (int[]) { 0x11*(i+1) });
+
+    printf("## fetch one sector with a single read\n");
+    read_calls = 0;
+    ck_assert(ringfs_fetch_many(&fs, objects, 16, &fetched) == 0);
+    ck_assert_int_eq(fetched, 10);
+    ck_assert_int_eq(read_calls, (10 + fs.slots_per_sector - 1) / fs.slots_per_sector);
+    for (int i=0; i<10; i++)
+        ck_assert_int_eq(objects[i], 0x11*(i+1));
+    assert_loc_equiv_to_offset(&fs, &fs.cursor, 10);
+    ck_assert(ringfs_fetch_many(&fs, objects, 16, &fetched) < 0);
+
+    printf("## small buffers, skipped slots\n");
+    ck_assert(ringfs_rewind(&fs) == 0);
+    ck_assert(ringfs_fetch(&fs, objects) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    for (int i=1; i<10; ) {
+        ck_assert(ringfs_fetch_many(&fs, objects, 2, &fetched) == 0);
+        for (int j=0; j<fetched; j++)
+            ck_assert_int_eq(objects[j], 0x11*(i+j+1));
+        i += fetched;
+    }
+    ck_assert(ringfs_fetch_many(&fs, objects, 1, &fetched) < 0);
+    assert_loc_equiv_to_offset(&fs, &fs.cursor, 10);
+}
+END_TEST
+
+START_TEST(test_ringfs_peek)
+{
+    printf("# test_ringfs_peek\n");
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+
+    for (int i=0; i<10; i++)
+        ringfs_append(&fs, (int[]) { 0x11*(i+1) });
+    int obj;
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+
+    printf("## no map: objects are copied into the buffer\n");
+    int buffer[16];
+    const void *objects[16];
+    int peeked;
+    ck_assert(ringfs_peek(&fs, &objects[0], buffer) == 0);
+    ck_assert(objects[0] == buffer);
+    ck_assert_int_eq(buffer[0], 0x22);
+    ck_assert(ringfs_peek_many(&fs, objects, 16, &peeked, buffer) == 0);
+    ck_assert_int_eq(peeked, 8);
+    for (int i=0; i<peeked; i++)
+        ck_assert_int_eq(*(const int *) objects[i], 0x11*(i+3));
+
+    printf("## map: objects are read in place\n");
+    struct ringfs_flash_partition mappable = flash;
+    mappable.map = op_map;
+    ringfs_init(&fs, &mappable, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&fs) == 0);
+    read_calls = 0;
+    map_calls = 0;
+    ck_assert(ringfs_peek(&fs, &objects[0], NULL) == 0);
+    ck_assert_int_eq(*(const int *) objects[0], 0x22);
+    ck_assert(ringfs_peek_many(&fs, objects, 4, &peeked, NULL) == 0);
+    ck_assert_int_eq(peeked, 4);
+    ck_assert(ringfs_peek_many(&fs, objects + 4, 16, &peeked, NULL) == 0);
+    ck_assert_int_eq(peeked, 4);
+    for (int i=0; i<8; i++)
+        ck_assert_int_eq(*(const int *) objects[i], 0x11*(i+3));
+    ck_assert(ringfs_peek(&fs, &objects[0], NULL) < 0);
+    ck_assert_int_eq(read_calls, 0);
+    ck_assert_int_le(map_calls, 2 + 2 + 4);
+    assert_loc_equiv_to_offset(&fs, &fs.cursor, 10);
+}
+END_TEST
+
+START_TEST(test_ringfs_background_erase)
+{
+    printf("# test_ringfs_background_erase\n");
+
+    struct ringfs_flash_partition part = flash;
+    part.program = op_program_idle;
+    part.sector_erase_start = op_sector_erase_start;
+    part.busy = op_busy;
+
+    struct ringfs fs;
+    ringfs_init(&fs, &part, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_background_erase(&fs, 1) == 0);
+    ringfs_format(&fs);
+    ck_assert(ringfs_poll(&fs) == 0);
+
+    printf("## appends don't erase when polled in between\n");
+    erase_calls = 0;
+    erase_start_calls = 0;
+    for (int i=0; i<3*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+        while (ringfs_poll(&fs) > 0);
+        assert_scan_integrity(&fs);
+    }
+    ck_assert_int_eq(erase_calls, 0);
+    ck_assert_int_gt(erase_start_calls, 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), ringfs_capacity(&fs));
+
+    printf("## appends wait for unfinished erases\n");
+    erase_start_calls = 0;
+    for (int i=0; i<2*fs.slots_per_sector; i++) {
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+        ringfs_poll(&fs);
+    }
+    ck_assert_int_eq(erase_calls, 0);
+    ck_assert_int_gt(erase_start_calls, 0);
+    while (ringfs_poll(&fs) > 0);
+    assert_scan_integrity(&fs);
+
+    printf("## and erase inline if never polled\n");
+    for (int i=0; i<2*fs.slots_per_sector; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    ck_assert_int_gt(erase_calls, 0);
+    assert_scan_integrity(&fs);
+
+    printf("## discarded sectors get erased too\n");
+    int obj;
+    while (ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    assert_scan_integrity(&fs);
+    erase_start_calls = 0;
+    while (ringfs_poll(&fs) > 0);
+    ck_assert_int_eq(erase_start_calls, fs.flash->sector_count - 1);
+    assert_scan_integrity(&fs);
+
+    printf("## format waits for an erase in progress\n");
+    for (int i=0; i<2*fs.slots_per_sector; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    while (ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert(ringfs_poll(&fs) > 0);
+    ck_assert_int_ge(erase_pending, 0);
+    ringfs_format(&fs);
+    ck_assert_int_eq(erase_pending, -1);
+    ck_assert(ringfs_poll(&fs) == 0);
+    ck_assert(ringfs_append(&fs, (int[]) { 42 }) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 42);
+    assert_scan_integrity(&fs);
+}
+END_TEST
+
+START_TEST(test_ringfs_reserve)
+{
+    printf("# test_ringfs_reserve\n");
+
+    struct ringfs_flash_partition part = flash;
+    part.sector_erase_start = op_sector_erase_start;
+    part.busy = op_busy;
+
+    struct ringfs fs;
+    ringfs_init(&fs, &part, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_reserve(&fs, 0) < 0);
+    ck_assert(ringfs_set_reserve(&fs, part.sector_count) < 0);
+    ck_assert(ringfs_set_reserve(&fs, 3) == 0);
+    ck_assert(ringfs_set_background_erase(&fs, 1) == 0);
+    ringfs_format(&fs);
+    ck_assert_int_eq(ringfs_capacity(&fs), 3 * fs.slots_per_sector);
+
+    printf("## fill up, keeping three sectors free\n");
+    for (int i=0; i<2*part.sector_count*fs.slots_per_sector; i++) {
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+        while (ringfs_poll(&fs) > 0);
+        ck_assert_int_le(ringfs_count_estimate(&fs), ringfs_capacity(&fs));
+    }
+    ck_assert_int_eq(ringfs_count_exact(&fs), ringfs_capacity(&fs));
+    assert_scan_integrity(&fs);
+
+    printf("## bursts of three sectors need no erase\n");
+    erase_calls = 0;
+    erase_start_calls = 0;
+    for (int i=0; i<3*fs.slots_per_sector; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    ck_assert_int_eq(erase_calls, 0);
+    ck_assert_int_eq(erase_start_calls, 0);
+    assert_scan_integrity(&fs);
+    ck_assert(ringfs_append(&fs, (int[]) { 0 }) == 0);
+    ck_assert_int_eq(erase_calls, 1);
+
+    printf("## the oldest sector made room\n");
+    int obj;
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, fs.slots_per_sector);
+    while (ringfs_poll(&fs) > 0);
+    assert_scan_integrity(&fs);
+}
+END_TEST
+
+/* Flash ops for concurrent producers: flashsim itself isn't thread safe. */
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int op_locked_sector_erase(struct ringfs_flash_partition *flash, int address)
+{
+    pthread_mutex_lock(&sim_mutex);
+    int result = op_sector_erase(flash, address);
+    pthread_mutex_unlock(&sim_mutex);
+    return result;
+}
+
+static ssize_t op_locked_program(struct ringfs_flash_partition *flash, int address, const void *data, size_t size)
+{
+    pthread_mutex_lock(&sim_mutex);
+    ssize_t result = op_program(flash, address, data, size);
+    pthread_mutex_unlock(&sim_mutex);
+    return result;
+}
+
+static ssize_t op_locked_read(struct ringfs_flash_partition *flash, int address, void *data, size_t size)
+{
+    pthread_mutex_lock(&sim_mutex);
+    ssize_t result = op_read(flash, address, data, size);
+    pthread_mutex_unlock(&sim_mutex);
+    return result;
+}
+
+#define PRODUCERS 4
+#define PRODUCER_OBJECTS 200
+
+static void *producer(void *arg)
+{
+    struct ringfs *fs = arg;
+    static int next_id;
+    int id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED) % PRODUCERS;
+    intptr_t failures = 0;
+
+    for (int i=0; i<PRODUCER_OBJECTS; i++)
+        if (ringfs_append_concurrent(fs, (int[]) { id << 16 | i }) != 0)
+            failures++;
+
+    return (void *) failures;
+}
+
+START_TEST(test_ringfs_append_concurrent)
+{
+    printf("# test_ringfs_append_concurrent\n");
+
+    /* Enough room for everything, with a few sector crossings. */
+    struct ringfs_flash_partition part = flash;
+    part.sector_size = 256;
+    part.sector_offset = 0;
+    part.sector_count = 32;
+    part.sector_erase = op_locked_sector_erase;
+    part.program = op_locked_program;
+    part.read = op_locked_read;
+    sim_open_scratch("tests/concurrent.sim", part.sector_size * part.sector_count, part.sector_size);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &part, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    ringfs_append(&fs, (int[]) { -1 });
+    ck_assert_int_ge(ringfs_capacity(&fs), PRODUCERS * PRODUCER_OBJECTS + 1);
+
+    printf("## producers append at once\n");
+    pthread_t threads[PRODUCERS];
+    for (int i=0; i<PRODUCERS; i++)
+        ck_assert(pthread_create(&threads[i], NULL, producer, &fs) == 0);
+    for (int i=0; i<PRODUCERS; i++) {
+        void *failures;
+        ck_assert(pthread_join(threads[i], &failures) == 0);
+        ck_assert(failures == NULL);
+    }
+    assert_scan_integrity(&fs);
+    ck_assert_int_eq(ringfs_count_exact(&fs), PRODUCERS * PRODUCER_OBJECTS + 1);
+
+    printf("## every object is there, in order per producer\n");
+    int obj;
+    int next[PRODUCERS] = { 0 };
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, -1);
+    while (ringfs_fetch(&fs, &obj) == 0) {
+        int id = obj >> 16;
+        ck_assert_int_eq(obj & 0xFFFF, next[id]);
+        next[id]++;
+    }
+    for (int i=0; i<PRODUCERS; i++)
+        ck_assert_int_eq(next[i], PRODUCER_OBJECTS);
+
+    printf("## and plain appends carry on from there\n");
+    ck_assert(ringfs_append(&fs, (int[]) { 42 }) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 42);
+    assert_scan_integrity(&fs);
+
+    sim_close_scratch();
+}
+END_TEST
+
+START_TEST(test_ringfs_append_concurrent_failure)
+{
+    printf("# test_ringfs_append_concurrent_failure\n");
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    for (int i=0; i<fs.slots_per_sector; i++)
+        ck_assert(ringfs_append_concurrent(&fs, (int[]) { i }) == 0);
+
+    printf("## no slot of a sector that can't be prepared gets written\n");
+    int sector_addr = (flash.sector_offset + 1) * flash.sector_size;
+    flashsim_program(sim, sector_addr, (uint8_t *) (uint32_t[]) { 0x5A5A5A00 }, 4);
+    for (int i=0; i<fs.slots_per_sector; i++)
+        ck_assert(ringfs_append_concurrent(&fs, (int[]) { 0x100 + i }) != 0);
+    for (int i=0; i<fs.slots_per_sector; i++) {
+        uint32_t status;
+        flashsim_read(sim, sector_addr + SECTOR_HEADER_SIZE + i * (SLOT_HEADER_SIZE + sizeof(object_t)),
+                (uint8_t *) &status, sizeof(status));
+        ck_assert_int_eq(status, 0xFFFFFFFF);
+    }
+
+    printf("## appends carry on in the next sector\n");
+    ck_assert(ringfs_append_concurrent(&fs, (int[]) { 0x200 }) == 0);
+    ck_assert_int_eq(fs.write.sector, 2);
+    ck_assert_int_eq(fs.write.slot, 1);
+    int obj;
+    for (int i=0; i<fs.slots_per_sector; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 0x200);
+
+    printf("## write heads must fit in 16 bits\n");
+    struct ringfs_flash_partition huge = flash;
+    huge.sector_count = 0x10000;
+    ringfs_init(&fs, &huge, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_append_concurrent(&fs, (int[]) { 0 }) != 0);
+}
+END_TEST
+
+START_TEST(test_ringfs_consumers)
+{
+    printf("# test_ringfs_consumers\n");
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+
+    struct ringfs_consumer uplink, analytics;
+    ck_assert(ringfs_consumer_add(&fs, &uplink, "uplink") == 0);
+    ck_assert(ringfs_consumer_add(&fs, &analytics, "analytics") == 0);
+    ck_assert(ringfs_consumer_find(&fs, "uplink") == &uplink);
+    ck_assert(ringfs_consumer_find(&fs, "analytics") == &analytics);
+    ck_assert(ringfs_consumer_find(&fs, "nobody") == NULL);
+
+    for (int i=0; i<6; i++)
+        ringfs_append(&fs, (int[]) { i });
+
+    printf("## the slowest consumer holds discards back\n");
+    int obj;
+    for (int i=0; i<4; i++) {
+        ck_assert(ringfs_consumer_fetch(&fs, &uplink, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_consumer_discard(&fs, &uplink) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 6);
+
+    for (int i=0; i<2; i++) {
+        ck_assert(ringfs_consumer_fetch(&fs, &analytics, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_consumer_discard(&fs, &analytics) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 4);
+    assert_scan_integrity(&fs);
+
+    for (int i=2; i<6; i++) {
+        ck_assert(ringfs_consumer_fetch(&fs, &analytics, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_consumer_fetch(&fs, &analytics, &obj) < 0);
+    ck_assert(ringfs_consumer_discard(&fs, &analytics) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 2);
+    assert_scan_integrity(&fs);
+
+    printf("## the main cursor is held back too\n");
+    while (ringfs_fetch(&fs, &obj) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 2);
+
+    printf("## consumers rewind to what they discarded\n");
+    ck_assert(ringfs_consumer_fetch(&fs, &uplink, &obj) == 0);
+    ck_assert_int_eq(obj, 4);
+    ck_assert(ringfs_consumer_rewind(&fs, &uplink) == 0);
+    ck_assert(ringfs_consumer_fetch(&fs, &uplink, &obj) == 0);
+    ck_assert_int_eq(obj, 4);
+
+    printf("## consumers follow the read head on overflow\n");
+    for (int i=6; i<30; i++)
+        ringfs_append(&fs, (int[]) { i });
+    ck_assert(ringfs_consumer_fetch(&fs, &uplink, &obj) == 0);
+    int oldest = obj;
+    ck_assert_int_gt(oldest, 5);
+    ck_assert(ringfs_consumer_fetch(&fs, &analytics, &obj) == 0);
+    ck_assert_int_eq(obj, oldest);
+    ck_assert(ringfs_rewind(&fs) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, oldest);
+
+    printf("## without consumers, everything goes\n");
+    ck_assert(ringfs_consumer_remove(&fs, &uplink) == 0);
+    ck_assert(ringfs_consumer_remove(&fs, &uplink) < 0);
+    ck_assert(ringfs_consumer_remove(&fs, &analytics) == 0);
+    while (ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 29);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+    assert_scan_integrity(&fs);
+}
+END_TEST
+
+START_TEST(test_ringfs_consumers_main_cursor)
+{
+    printf("# test_ringfs_consumers_main_cursor\n");
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    struct ringfs_consumer uplink;
+    ck_assert(ringfs_consumer_add(&fs, &uplink, "uplink") == 0);
+    for (int i=0; i<10; i++)
+        ringfs_append(&fs, (int[]) { i });
+
+    printf("## an unused main cursor doesn't hold consumers back\n");
+    int obj;
+    for (int i=0; i<3; i++)
+        ck_assert(ringfs_consumer_fetch(&fs, &uplink, &obj) == 0);
+    ck_assert(ringfs_consumer_discard(&fs, &uplink) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 7);
+    assert_scan_integrity(&fs);
+
+    printf("## once used, a consumer doesn't discard what it hasn't fetched\n");
+    ck_assert(ringfs_rewind(&fs) == 0);
+    while (ringfs_consumer_fetch(&fs, &uplink, &obj) == 0);
+    ck_assert(ringfs_consumer_discard(&fs, &uplink) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 7);
+    assert_scan_integrity(&fs);
+
+    printf("## but follows it once it has\n");
+    for (int i=3; i<7; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_consumer_discard(&fs, &uplink) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 3);
+    assert_scan_integrity(&fs);
+    for (int i=7; i<10; i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_fetch(&fs, &obj) < 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+    assert_scan_integrity(&fs);
+
+    printf("## a scan leaves it unused again\n");
+    for (int i=10; i<14; i++)
+        ringfs_append(&fs, (int[]) { i });
+    ck_assert(ringfs_scan(&fs) == 0);
+    while (ringfs_consumer_fetch(&fs, &uplink, &obj) == 0);
+    ck_assert(ringfs_consumer_discard(&fs, &uplink) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+    assert_scan_integrity(&fs);
+}
+END_TEST
+
+START_TEST(test_ringfs_sequence)
+{
+    printf("# test_ringfs_sequence\n");
+
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_features(&fs, RINGFS_FEATURE_SEQUENCE | RINGFS_FEATURE_VARIABLE) != 0);
+    ck_assert(ringfs_set_features(&fs, RINGFS_FEATURE_SEQUENCE) == 0);
+    ringfs_format(&fs);
+
+    /* Objects are their own sequence numbers here. */
+    uint32_t sequence;
+    int obj;
+    for (int i=0; i<10; i++)
+        ringfs_append(&fs, (int[]) { i });
+    ck_assert(ringfs_tell(&fs, &sequence) == 0);
+    ck_assert_int_eq(sequence, 0);
+    for (int i=0; i<3; i++)
+        ringfs_fetch(&fs, &obj);
+    ck_assert(ringfs_tell(&fs, &sequence) == 0);
+    ck_assert_int_eq(sequence, 3);
+
+    printf("## seek within the ring\n");
+    ck_assert(ringfs_seek(&fs, 7) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 7);
+    ck_assert(ringfs_seek(&fs, 1) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 1);
+    ck_assert(ringfs_seek(&fs, 10) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+    ck_assert(ringfs_seek(&fs, 11) != 0);
+
+    printf("## discarded and overwritten objects are gone\n");
+    ck_assert(ringfs_seek(&fs, 4) == 0);
+    ringfs_discard(&fs);
+    ck_assert(ringfs_seek(&fs, 3) != 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 6);
+    for (int i=10; i<40; i++)
+        ringfs_append(&fs, (int[]) { i });
+    ringfs_rewind(&fs);
+    ck_assert(ringfs_tell(&fs, &sequence) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, sequence);
+    ck_assert(ringfs_seek(&fs, sequence - 1) != 0);
+    ck_assert(ringfs_seek(&fs, 33) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 33);
+
+    printf("## numbers survive remounts, even of an empty ring\n");
+    struct ringfs fs2;
+    ringfs_init(&fs2, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_set_features(&fs2, RINGFS_FEATURE_SEQUENCE);
+    ck_assert(ringfs_scan(&fs2) == 0);
+    ck_assert(ringfs_seek(&fs2, 33) == 0);
+    ck_assert(ringfs_fetch(&fs2, &obj) == 0);
+    ck_assert_int_eq(obj, 33);
+    while (ringfs_fetch(&fs2, &obj) == 0);
+    ringfs_discard(&fs2);
+    ck_assert_int_eq(ringfs_count_exact(&fs2), 0);
+
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert(ringfs_tell(&fs, &sequence) == 0);
+    ck_assert_int_eq(sequence, 40);
+    ringfs_append(&fs, (int[]) { 40 });
+    ck_assert(ringfs_seek(&fs, 40) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 40);
+    assert_scan_integrity(&fs);
+}
+END_TEST
+
+static uint32_t key_int(const void *object, int size)
+{
+    (void) size;
+    return *(const object_t *) object;
+}
+
+START_TEST(test_ringfs_key_range)
+{
+    printf("# test_ringfs_key_range\n");
+
+    /* Five slots per sector. */
+    struct ringfs_flash_partition part = flash;
+    part.sector_size = 64;
+    part.sector_offset = 0;
+    part.sector_count = 8;
+    sim_open_scratch("tests/keys.sim", part.sector_size * part.sector_count, part.sector_size);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &part, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_features(&fs, RINGFS_FEATURE_KEY_RANGE) == 0);
+    ck_assert(ringfs_set_key(&fs, key_int) == 0);
+    ringfs_format(&fs);
+    ck_assert_int_eq(fs.slots_per_sector, 5);
+
+    /* Timestamps, ten apart. */
+    for (int i=0; i<32; i++)
+        ringfs_append(&fs, (int[]) { 10*i });
+    assert_scan_integrity(&fs);
+
+    printf("## a time window only reads the sectors it overlaps\n");
+    int obj, size;
+    read_calls = 0;
+    for (int t=120; t<=170; t+=10) {
+        ck_assert(ringfs_fetch_range(&fs, 115, 175, &obj, &size) == 0);
+        ck_assert_int_eq(obj, t);
+        ck_assert_int_eq(size, sizeof(object_t));
+    }
+    ck_assert(ringfs_fetch_range(&fs, 115, 175, &obj, &size) != 0);
+    ck_assert_int_lt(read_calls, 32);
+    ck_assert(ringfs_fetch(&fs, &obj) != 0);
+
+    printf("## seek to a key\n");
+    ck_assert(ringfs_seek_key(&fs, 200) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 200);
+    ck_assert(ringfs_seek_key(&fs, 215) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 200);
+    ck_assert(ringfs_seek_key(&fs, 310) == 0);
+    ck_assert(ringfs_fetch(&fs, &obj) == 0);
+    ck_assert_int_eq(obj, 300);
+    ck_assert(ringfs_seek_key(&fs, 320) != 0);
+
+    printf("## ranges survive remounts and overflows\n");
+    ck_assert(ringfs_scan(&fs) == 0);
+    for (int i=32; i<64; i++)
+        ringfs_append(&fs, (int[]) { 10*i });
+    ck_assert(ringfs_seek_key(&fs, 300) == 0);
+    for (int t=300; t<=330; t+=10) {
+        ck_assert(ringfs_fetch_range(&fs, 300, 330, &obj, &size) == 0);
+        ck_assert_int_eq(obj, t);
+    }
+    ck_assert(ringfs_fetch_range(&fs, 300, 330, &obj, &size) != 0);
+    ringfs_rewind(&fs);
+    ck_assert(ringfs_fetch_range(&fs, 0, 100, &obj, &size) != 0);
+    ringfs_rewind(&fs);
+    ck_assert(ringfs_fetch_range(&fs, 630, 630, &obj, &size) == 0);
+    ck_assert_int_eq(obj, 630);
+    assert_scan_integrity(&fs);
+
+    sim_close_scratch();
+}
+END_TEST
+
+#ifdef RINGFS_STATS
+START_TEST(test_ringfs_stats)
+{
+    printf("# test_ringfs_stats\n");
+
+    struct ringfs fs;
+    struct ringfs_stats stats;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_stats_get(&fs, &stats) == 0);
+    ck_assert_int_eq(stats.calls[RINGFS_CALL_FORMAT].programs, 0);
+
+    printf("## ops are counted per call\n");
+    ringfs_format(&fs);
+    ringfs_append(&fs, (int[]) { 1 });
+    ringfs_stats_get(&fs, &stats);
+    ck_assert_int_eq(stats.calls[RINGFS_CALL_FORMAT].erases, flash.sector_count);
+    ck_assert_int_eq(stats.calls[RINGFS_CALL_APPEND].erases, 0);
+    ck_assert_int_gt(stats.calls[RINGFS_CALL_APPEND].programs, 0);
+
+    printf("## an append within a sector: reserve, write, commit\n");
+    ringfs_stats_reset(&fs);
+    ringfs_append(&fs, (int[]) { 2 });
+    ringfs_stats_get(&fs, &stats);
+    ck_assert_int_eq(stats.calls[RINGFS_CALL_APPEND].programs, 3);
+    ck_assert_int_eq(stats.calls[RINGFS_CALL_APPEND].program_bytes, 2*SLOT_HEADER_SIZE + sizeof(object_t));
+    ck_assert_int_eq(stats.calls[RINGFS_CALL_FORMAT].erases, 0);
+
+    printf("## a fetch reads the slot header and the object\n");
+    int obj;
+    ringfs_fetch(&fs, &obj);
+    ringfs_stats_get(&fs, &stats);
+    ck_assert_int_eq(stats.calls[RINGFS_CALL_FETCH].reads, 2);
+    ck_assert_int_eq(stats.calls[RINGFS_CALL_FETCH].read_bytes, SLOT_HEADER_SIZE + sizeof(object_t));
+    ck_assert_int_eq(stats.calls[RINGFS_CALL_FETCH].programs, 0);
+}
+END_TEST
+#endif
+
+START_TEST(test_ringfs_wear)
+{
+    printf("# test_ringfs_wear\n");
+
+    struct ringfs fs;
+    struct ringfs_wear wear;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_wear_report(&fs, &wear) != 0);
+    ck_assert(ringfs_set_features(&fs, RINGFS_FEATURE_ERASE_COUNT) == 0);
+
+    printf("## format counts the first erase\n");
+    ringfs_format(&fs);
+    ck_assert(ringfs_wear_report(&fs, &wear) == 0);
+    ck_assert_int_eq(wear.sectors, flash.sector_count);
+    ck_assert_int_eq(wear.min, 1);
+    ck_assert_int_eq(wear.max, 1);
+    ck_assert_int_eq(wear.mean, 1);
+
+    printf("## counts survive erases and formats\n");
+    for (int i=0; i<10*ringfs_capacity(&fs); i++)
+        ringfs_append(&fs, (int[]) { i });
+    assert_scan_integrity(&fs);
+    ck_assert(ringfs_wear_report(&fs, &wear) == 0);
+    ck_assert_int_ge(wear.min, 8);
+    ck_assert_int_le(wear.max - wear.min, 1);
+    uint32_t max = wear.max;
+    ringfs_format(&fs);
+    ck_assert(ringfs_wear_report(&fs, &wear) == 0);
+    ck_assert_int_eq(wear.max, max + 1);
+
+    printf("## a count lost to a power cut comes from the sector before\n");
+    int lost = flash.sector_count - 1;
+    flashsim_sector_erase(sim, (flash.sector_offset + lost) * flash.sector_size);
+    ck_assert(ringfs_wear_report(&fs, &wear) == 0);
+    ck_assert_int_eq(wear.sectors, flash.sector_count - 1);
+    for (int i=0; i<ringfs_capacity(&fs); i++)
+        ringfs_append(&fs, (int[]) { i });
+    assert_scan_integrity(&fs);
+    ck_assert(ringfs_wear_report(&fs, &wear) == 0);
+    ck_assert_int_eq(wear.sectors, flash.sector_count);
+    ck_assert_int_le(wear.max - wear.min, 1);
+}
+END_TEST
+
+/* Sectors erased below the coalescing layer must say so on the flash first. */
+static int erasing_seen;
+
+static void assert_erasing(int address)
+{
+    uint32_t status;
+    flashsim_read(sim, address, (uint8_t *) &status, sizeof(status));
+    ck_assert(status == 0xFF000000 || status == 0x00000000);
+    if (status == 0xFF000000)
+        erasing_seen++;
+}
+
+static int op_sector_erase_erasing(struct ringfs_flash_partition *flash, int address)
+{
+    assert_erasing(address);
+    return op_sector_erase(flash, address);
+}
+
+static int op_sector_erase_start_erasing(struct ringfs_flash_partition *flash, int address)
+{
+    assert_erasing(address);
+    return op_sector_erase_start(flash, address);
+}
+
+START_TEST(test_ringfs_coalesce)
+{
+    printf("# test_ringfs_coalesce\n");
+
+    uint8_t page[32];
+    struct ringfs_coalesce coalesce;
+    ck_assert(ringfs_coalesce_init(&coalesce, &flash, page, 12) != 0);
+    ck_assert(ringfs_coalesce_init(&coalesce, &flash, page, sizeof(page)) == 0);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &coalesce.flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+
+    printf("## an append takes two programs\n");
+    ringfs_append(&fs, (int[]) { 0x11 });
+    program_calls = 0;
+    ringfs_append(&fs, (int[]) { 0x22 });
+    ck_assert_int_eq(program_calls, 2);
+
+    printf("## pending programs are read back, and durable after sync\n");
+    struct ringfs lower;
+    ringfs_init(&lower, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&lower) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&lower), 1);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 2);
+    ck_assert(ringfs_sync(&fs) == 0);
+    ck_assert(ringfs_scan(&lower) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&lower), 2);
+
+    printf("## objects survive wraparounds\n");
+    for (int i=0; i<3*ringfs_capacity(&fs); i++)
+        ringfs_append(&fs, (int[]) { i });
+    assert_scan_integrity(&fs);
+    ringfs_sync(&fs);
+    ck_assert(ringfs_scan(&lower) == 0);
+    int count = ringfs_count_exact(&fs);
+    ck_assert_int_eq(ringfs_count_exact(&lower), count);
+    int obj;
+    for (int i=3*ringfs_capacity(&fs)-count; i<3*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_fetch(&lower, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+
+    printf("## batches take fewer programs than without the layer\n");
+    int batch[9];
+    for (int i=0; i<9; i++)
+        batch[i] = 0x100 + i;
+    ringfs_format(&lower);
+    program_calls = 0;
+    ck_assert(ringfs_append_batch(&lower, batch, 9) == 0);
+    int direct = program_calls;
+    ringfs_format(&fs);
+    ringfs_sync(&fs);
+    program_calls = 0;
+    ck_assert(ringfs_append_batch(&fs, batch, 9) == 0);
+    ringfs_sync(&fs);
+    ck_assert_int_lt(program_calls, direct);
+    ck_assert(ringfs_scan(&lower) == 0);
+    for (int i=0; i<9; i++) {
+        ck_assert(ringfs_fetch(&lower, &obj) == 0);
+        ck_assert_int_eq(obj, 0x100 + i);
+    }
+    assert_scan_integrity(&fs);
+
+    printf("## programs spanning pages go straight through\n");
+    uint8_t erased[sizeof(page) + 8];
+    memset(erased, 0xFF, sizeof(erased));
+    program_calls = 0;
+    int address = flash.sector_offset * flash.sector_size + 4;
+    ck_assert(coalesce.flash.program(&coalesce.flash, address, erased, sizeof(erased)) == sizeof(erased));
+    ck_assert_int_eq(program_calls, 1);
+
+    printf("## sectors are marked ERASING on the flash before erases\n");
+    struct ringfs_flash_partition checked = flash;
+    checked.sector_erase = op_sector_erase_erasing;
+    ck_assert(ringfs_coalesce_init(&coalesce, &checked, page, sizeof(page)) == 0);
+    ringfs_init(&fs, &coalesce.flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+    erasing_seen = 0;
+    erase_calls = 0;
+    for (int i=0; i<2*ringfs_capacity(&fs); i++)
+        ringfs_append(&fs, (int[]) { i });
+    ck_assert_int_gt(erase_calls, 0);
+    ck_assert_int_eq(erasing_seen, erase_calls);
+
+    printf("## and before background erases\n");
+    checked.sector_erase_start = op_sector_erase_start_erasing;
+    checked.busy = op_busy;
+    ck_assert(ringfs_coalesce_init(&coalesce, &checked, page, sizeof(page)) == 0);
+    ringfs_init(&fs, &coalesce.flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_background_erase(&fs, 1) == 0);
+    ringfs_format(&fs);
+    erasing_seen = 0;
+    erase_start_calls = 0;
+    for (int i=0; i<2*ringfs_capacity(&fs); i++) {
+        ringfs_append(&fs, (int[]) { i });
+        while (ringfs_poll(&fs) > 0);
+    }
+    ck_assert_int_gt(erase_start_calls, 0);
+    ck_assert_int_eq(erasing_seen, erase_start_calls);
+    assert_scan_integrity(&fs);
+}
+END_TEST
+
+/* Flash with 8 byte program units that can't be programmed twice. */
+static ssize_t op_program_unit(struct ringfs_flash_partition *flash, int address, const void *data, size_t size)
+{
+    uint8_t current[256];
+    ck_assert_int_eq(address % 8, 0);
+    ck_assert_int_eq(size % 8, 0);
+    ck_assert_int_le(size, sizeof(current));
+    flashsim_read(sim, address, current, size);
+    for (size_t i=0; i<size; i++)
+        ck_assert_int_eq(current[i], 0xFF);
+    return op_program(flash, address, data, size);
+}
+
+START_TEST(test_ringfs_program_unit)
+{
+    printf("# test_ringfs_program_unit\n");
+
+    struct ringfs_flash_partition part = flash;
+    part.sector_size = 256;
+    part.sector_offset = 0;
+    part.sector_count = 6;
+    part.program = op_program_unit;
+    sim_open_scratch("tests/units.sim", part.sector_size * part.sector_count, part.sector_size);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &part, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_program_unit(&fs, 4) != 0);
+    ck_assert(ringfs_set_program_unit(&fs, 12) != 0);
+    ck_assert(ringfs_set_features(&fs, RINGFS_FEATURE_VARIABLE) == 0);
+    ck_assert(ringfs_set_program_unit(&fs, 8) != 0);
+    ck_assert(ringfs_set_features(&fs, RINGFS_FEATURE_DISCARD_MARKS | RINGFS_FEATURE_SEQUENCE |
+                RINGFS_FEATURE_KEY_RANGE | RINGFS_FEATURE_ERASE_COUNT) == 0);
+    ck_assert(ringfs_set_program_unit(&fs, 8) == 0);
+    ck_assert(ringfs_set_features(&fs, RINGFS_FEATURE_VARIABLE) != 0);
+    ck_assert(ringfs_set_key(&fs, key_int) == 0);
+
+    printf("## statuses and padded payloads in units of their own\n");
+    ringfs_format(&fs);
+    /* 104 byte header, then 24 bytes of slot statuses and a padded payload. */
+    ck_assert_int_eq(fs.slots_per_sector, 4);
+    ringfs_format(&fs);
+
+    printf("## every unit is programmed once through wraparounds\n");
+    int next = 0, expected = 0;
+    for (int round=0; round<20; round++) {
+        int obj[4], fetched;
+        for (int i=0; i<5; i++, next++)
+            ringfs_append(&fs, (int[]) { next });
+        ringfs_append_batch(&fs, (int[]) { next, next+1, next+2 }, 3);
+        next += 3;
+        /* Old objects get overwritten along the way. */
+        ringfs_rewind(&fs);
+        ck_assert(ringfs_fetch(&fs, &obj[0]) == 0);
+        if (obj[0] > expected)
+            expected = obj[0];
+        ck_assert_int_eq(obj[0], expected++);
+        ck_assert(ringfs_fetch_many(&fs, obj, 4, &fetched) == 0);
+        for (int i=0; i<fetched; i++)
+            ck_assert_int_eq(obj[i], expected++);
+        ringfs_discard(&fs);
+        /* Slots are marked GARBAGE one at a time once the marks run out. */
+        if (fs.read.slot < fs.slots_per_sector - 1) {
+            ringfs_item_discard(&fs);
+            expected++;
+        }
+        assert_scan_integrity(&fs);
+    }
+
+    printf("## header fields read back\n");
+    uint32_t sequence;
+    ck_assert(ringfs_tell(&fs, &sequence) == 0);
+    ck_assert_int_eq(sequence, expected);
+    int obj, size;
+    ck_assert(ringfs_fetch_range(&fs, next - 2, next - 1, &obj, &size) == 0);
+    ck_assert_int_eq(obj, next - 2);
+    struct ringfs_wear wear;
+    ck_assert(ringfs_wear_report(&fs, &wear) == 0);
+    ck_assert_int_ge(wear.min, 2);
+
+    printf("## sequence numbers left by a power loss aren't programmed again\n");
+    /* After the status, the version and four discard marks. */
+    const int sequence_offset = 72;
+    while (fs.write.slot == 0)
+        ringfs_append(&fs, (int[]) { next++ });
+    uint32_t words[2];
+    flashsim_read(sim, fs.write.sector * part.sector_size + sequence_offset, (uint8_t *) words, sizeof(words));
+    ck_assert_int_eq(words[0], fs.sequence);
+    ck_assert_int_eq(words[1], ~fs.sequence);
+    for (int ahead=1; ahead<=2; ahead++) {
+        /* The number the sector will get, then some other one. */
+        int sector = (fs.write.sector + 1) % part.sector_count;
+        uint32_t left = fs.sequence + fs.slots_per_sector + (ahead - 1) * 1000;
+        flashsim_program(sim, sector * part.sector_size + sequence_offset,
+                (uint8_t *) (uint32_t[]) { left, ~left }, sizeof(words));
+        while (fs.write.sector != sector || fs.write.slot == 0)
+            ringfs_append(&fs, (int[]) { next++ });
+        flashsim_read(sim, sector * part.sector_size + sequence_offset, (uint8_t *) words, sizeof(words));
+        ck_assert_int_eq(words[0], fs.sequence);
+        ck_assert_int_eq(words[1], ~fs.sequence);
+        assert_scan_integrity(&fs);
+    }
+
+    sim_close_scratch();
+}
+END_TEST
+
+START_TEST(test_ringfs_read_cache)
+{
+    printf("# test_ringfs_read_cache\n");
+
+    uint8_t cache[2 * 32];
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_read_cache(&fs, cache, sizeof(cache), 12) != 0);
+    ck_assert(ringfs_set_read_cache(&fs, cache, 16, 32) != 0);
+    ck_assert(ringfs_set_read_cache(&fs, cache, sizeof(cache), flash.sector_size) == 0);
+    ringfs_format(&fs);
+
+    printf("## fetching takes one read per sector\n");
+    for (int i=0; i<ringfs_capacity(&fs); i++)
+        ringfs_append(&fs, (int[]) { i });
+    read_calls = 0;
+    int obj;
+    for (int i=0; i<ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert_int_le(read_calls, flash.sector_count);
+    ringfs_discard(&fs);
+
+    printf("## programs and erases leave nothing stale behind\n");
+    int expected = 0;
+    for (int i=0; i<4*ringfs_capacity(&fs); i++) {
+        ringfs_append(&fs, (int[]) { i });
+        if (i % 3 == 0) {
+            ck_assert(ringfs_fetch(&fs, &obj) == 0);
+            ck_assert_int_ge(obj, expected);
+            expected = obj + 1;
+        }
+        if (i % 7 == 0)
+            ringfs_discard(&fs);
+    }
+    struct ringfs uncached;
+    ringfs_init(&uncached, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&uncached) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), ringfs_count_exact(&uncached));
+    assert_scan_integrity(&fs);
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), ringfs_count_exact(&uncached));
+}
+END_TEST
+
+/* Two devices sharing the simulator: sectors 4-6 and 7-9. */
+static int stripe_device(int address)
+{
+    return address / flash.sector_size >= 7;
+}
+
+/* Programs issued while an erase runs, by device relative to the erase. */
+static int programs_during_erase[2];
+
+static ssize_t op_program_stripe(struct ringfs_flash_partition *flash, int address, const void *data, size_t size)
+{
+    if (erase_pending >= 0)
+        programs_during_erase[stripe_device(address) != stripe_device(erase_pending)]++;
+    return op_program(flash, address, data, size);
+}
+
+START_TEST(test_ringfs_stripe)
+{
+    printf("# test_ringfs_stripe\n");
+
+    struct ringfs_flash_partition device0 = flash;
+    device0.sector_count = 3;
+    device0.program = op_program_stripe;
+    device0.sector_erase_start = op_sector_erase_start;
+    device0.busy = op_busy;
+    struct ringfs_flash_partition device1 = device0;
+    device1.sector_offset = 7;
+    struct ringfs_flash_partition other = device1;
+    other.sector_size = 64;
+    struct ringfs_flash_partition *devices[] = { &device0, &device1, &other };
+
+    struct ringfs_stripe stripe;
+    ck_assert(ringfs_stripe_init(&stripe, devices, 0) != 0);
+    ck_assert(ringfs_stripe_init(&stripe, devices, 3) != 0);
+    ck_assert(ringfs_stripe_init(&stripe, devices, 2) == 0);
+    ck_assert_int_eq(stripe.flash.sector_count, 6);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &stripe.flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_background_erase(&fs, 1) == 0);
+    ringfs_format(&fs);
+
+    printf("## consecutive sectors alternate between devices\n");
+    for (int i=0; i<fs.slots_per_sector+1; i++)
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+    static const int physical[] = { 4, 7, 5 };
+    uint32_t status[3];
+    for (int i=0; i<3; i++)
+        flashsim_read(sim, physical[i] * flash.sector_size, (uint8_t *) &status[i], sizeof(status[i]));
+    ck_assert_int_eq(status[0], 0xFFFF0000);
+    ck_assert_int_eq(status[1], 0xFFFF0000);
+    ck_assert_int_eq(status[2], 0xFFFFFF00);
+
+    printf("## appends go on while the other device erases\n");
+    programs_during_erase[0] = programs_during_erase[1] = 0;
+    for (int i=0; i<3*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_append(&fs, (int[]) { i }) == 0);
+        ringfs_poll(&fs);
+    }
+    ck_assert_int_gt(programs_during_erase[1], 0);
+    ck_assert_int_eq(programs_during_erase[0], 0);
+    while (ringfs_poll(&fs) > 0);
+    assert_scan_integrity(&fs);
+
+    printf("## objects come back in order\n");
+    int count = ringfs_count_exact(&fs);
+    int obj;
+    for (int i=3*ringfs_capacity(&fs)-count; i<3*ringfs_capacity(&fs); i++) {
+        ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ck_assert_int_eq(obj, i);
+    }
+    ck_assert(ringfs_fetch(&fs, &obj) < 0);
+}
+END_TEST
+
+START_TEST(test_ringfs_sector_table)
+{
+    printf("# test_ringfs_sector_table\n");
+
+    struct ringfs_sector_info table[6];
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_sector_table(&fs, table) == 0);
+    ringfs_format(&fs);
+
+    printf("## appends inside a sector read no headers\n");
+    ringfs_append(&fs, (int[]) { 0x11 });
+    read_calls = 0;
+    for (int i=1; i<fs.slots_per_sector; i++)
+        ringfs_append(&fs, (int[]) { 0x11*(i+1) });
+    ck_assert_int_eq(read_calls, 0);
+    assert_scan_integrity(&fs);
+
+    printf("## table survives wraparounds\n");
+    read_calls = 0;
+    for (int i=0; i<3*ringfs_capacity(&fs); i++)
+        ringfs_append(&fs, (int[]) { i });
+    ck_assert_int_eq(read_calls, 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), ringfs_count_estimate(&fs));
+    assert_scan_integrity(&fs);
+
+    printf("## scan fills the table\n");
+    struct ringfs_sector_info table2[6];
+    struct ringfs fs2;
+    ringfs_init(&fs2, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_set_sector_table(&fs2, table2) == 0);
+    ck_assert(ringfs_scan(&fs2) == 0);
+    for (int i=0; i<flash.sector_count; i++)
+        ck_assert_int_eq(table2[i].status, table[i].status);
+}
+END_TEST
+
+/* Count objects the slow way, walking every slot between read and write. */
+static int count_exact_walk(const struct ringfs *fs)
+{
+    struct ringfs copy = *fs;
+    copy.sectors = NULL;
+    return ringfs_count_exact(&copy);
+}
+
+START_TEST(test_ringfs_count_table)
+{
+    printf("# test_ringfs_count_table\n");
+
+    struct ringfs_sector_info table[6];
+    struct ringfs fs;
+    ringfs_init(&fs, &flash, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_set_sector_table(&fs, table);
+    ringfs_format(&fs);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+
+    printf("## counts follow appends, fetches and discards\n");
+    unsigned int seed = 1;
+    for (int i=0; i<500; i++) {
+        int obj[4];
+        int fetched;
+        seed = seed * 1103515245 + 12345;
+        switch ((seed >> 16) % 8) {
+            case 0: case 1: case 2: ringfs_append(&fs, (int[]) { i }); break;
+            case 3: ringfs_append_batch(&fs, (int[]) { i, i, i, i }, 4); break;
+            case 4: ringfs_fetch(&fs, obj); break;
+            case 5: ringfs_fetch_many(&fs, obj, 4, &fetched); break;
+            case 6: ringfs_discard(&fs); break;
+            case 7: ringfs_rewind(&fs); break;
+        }
+        ck_assert_int_eq(ringfs_count_exact(&fs), count_exact_walk(&fs));
+    }
+
+    printf("## warm counts need no flash reads\n");
+    read_calls = 0;
+    ringfs_count_exact(&fs);
+    ck_assert_int_eq(read_calls, 0);
+
+    printf("## rescan counts lazily\n");
+    ck_assert(ringfs_scan(&fs) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs), count_exact_walk(&fs));
+    read_calls = 0;
+    ringfs_count_exact(&fs);
+    ck_assert_int_eq(read_calls, 0);
+}
+END_TEST
+
+START_TEST(test_ringfs_scan_large_sectors)
+{
+    printf("# test_ringfs_scan_large_sectors\n");
+
+    /* Large sectors with small objects: 127 slots per sector. */
+    struct ringfs_flash_partition large = flash;
+    large.sector_size = 1024;
+    large.sector_offset = 0;
+    large.sector_count = 4;
+    sim_open_scratch("tests/large.sim", large.sector_size * large.sector_count, large.sector_size);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &large, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_format(&fs);
+
+    int obj;
+    for (int round=0; round<3; round++) {
+        printf("## append, discard some, rescan\n");
+        for (int i=0; i<100; i++)
+            ringfs_append(&fs, (int[]) { i });
+        for (int i=0; i<60; i++)
+            ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ringfs_discard(&fs);
+
+        read_calls = 0;
+        assert_scan_integrity(&fs);
+        /* Headers, then a couple of binary searches instead of slot walks. */
+        ck_assert_int_le(read_calls, large.sector_count + 3 * 8);
+    }
+
+    printf("## fully discarded sectors are skipped\n");
+    while (ringfs_fetch(&fs, &obj) == 0);
+    ringfs_discard(&fs);
+    read_calls = 0;
+    assert_scan_integrity(&fs);
+    ck_assert_int_le(read_calls, large.sector_count + 3 * 8);
+
+    sim_close_scratch();
+}
+END_TEST
+
+START_TEST(test_ringfs_discard_marks)
+{
+    printf("# test_ringfs_discard_marks\n");
+
+    /* 128 byte sectors: 15 slots plain, 13 with discard marks. */
+    struct ringfs_flash_partition part = flash;
+    part.sector_size = 128;
+    part.sector_offset = 0;
+    part.sector_count = 6;
+    sim_open_scratch("tests/marks.sim", part.sector_size * part.sector_count, part.sector_size);
+
+    for (int marks=0; marks<2; marks++) {
+        struct ringfs fs;
+        ringfs_init(&fs, &part, DEFAULT_VERSION, sizeof(object_t));
+        ck_assert(ringfs_set_features(&fs, marks ? RINGFS_FEATURE_DISCARD_MARKS : 0) == 0);
+        ck_assert_int_eq(fs.slots_per_sector, marks ? 13 : 15);
+        ringfs_format(&fs);
+
+        int obj;
+        for (int i=0; i<3*fs.slots_per_sector+1; i++)
+            ringfs_append(&fs, (int[]) { i });
+
+        printf("## consumed sectors are retired with one program each\n");
+        for (int i=0; i<2*fs.slots_per_sector+4; i++)
+            ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        program_calls = 0;
+        ringfs_discard(&fs);
+        ck_assert_int_eq(program_calls, 2 + (marks ? 1 : 4));
+        assert_scan_integrity(&fs);
+
+        printf("## partial discards\n");
+        for (int round=0; round<4; round++) {
+            ck_assert(ringfs_fetch(&fs, &obj) == 0);
+            ck_assert(ringfs_fetch(&fs, &obj) == 0);
+            program_calls = 0;
+            ringfs_discard(&fs);
+            ck_assert_int_eq(program_calls, marks && round < 3 ? 1 : 2);
+            assert_scan_integrity(&fs);
+        }
+        ck_assert_int_eq(ringfs_count_exact(&fs), fs.slots_per_sector + 1 - 4 - 8);
+
+        printf("## discarding everything keeps an IN_USE sector\n");
+        while (fs.write.slot != 0)
+            ringfs_append(&fs, (int[]) { 0 });
+        while (ringfs_fetch(&fs, &obj) == 0);
+        ringfs_discard(&fs);
+        ck_assert_int_eq(ringfs_count_exact(&fs), 0);
+        assert_scan_integrity(&fs);
+
+        printf("## retired sectors get reused\n");
+        for (int i=0; i<ringfs_capacity(&fs); i++)
+            ringfs_append(&fs, (int[]) { i });
+        assert_scan_integrity(&fs);
+        ck_assert_int_eq(ringfs_count_exact(&fs), ringfs_capacity(&fs));
+    }
+
+    sim_close_scratch();
+}
+END_TEST
+
+START_TEST(test_ringfs_variable)
+{
+    printf("# test_ringfs_variable\n");
+
+    /* 128 byte sectors hold 120 bytes of records of up to 64 bytes. */
+    struct ringfs_flash_partition part = flash;
+    part.sector_size = 128;
+    part.sector_offset = 0;
+    part.sector_count = 6;
+    sim_open_scratch("tests/variable.sim", part.sector_size * part.sector_count, part.sector_size);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &part, DEFAULT_VERSION, 64);
+    ck_assert(ringfs_set_features(&fs, RINGFS_FEATURE_VARIABLE) == 0);
+    ringfs_format(&fs);
+
+    uint8_t record[64];
+    int size;
+    ck_assert(ringfs_append(&fs, record) < 0);
+    ck_assert(ringfs_fetch(&fs, record) < 0);
+    ck_assert(ringfs_append_var(&fs, record, 65) < 0);
+    ck_assert(ringfs_fetch_var(&fs, record, &size) < 0);
+
+    printf("## records are packed tightly\n");
+    for (int i=0; i<12; i++) {
+        memset(record, i, sizeof(record));
+        ck_assert(ringfs_append_var(&fs, record, i % 3 ? 2 : 40) == 0);
+        assert_scan_integrity(&fs);
+    }
+    /* 4 * 48 + 8 * 12 bytes, leaving the tail of the second sector unused. */
+    ck_assert_int_eq(fs.write.sector, 2);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 12);
+
+    for (int i=0; i<12; i++) {
+        ck_assert(ringfs_fetch_var(&fs, record, &size) == 0);
+        ck_assert_int_eq(size, i % 3 ? 2 : 40);
+        ck_assert_int_eq(record[0], i);
+        ck_assert_int_eq(record[size-1], i);
+    }
+    ck_assert(ringfs_fetch_var(&fs, record, &size) < 0);
+
+    printf("## partial discards\n");
+    ck_assert(ringfs_rewind(&fs) == 0);
+    for (int i=0; i<5; i++)
+        ck_assert(ringfs_fetch_var(&fs, record, &size) == 0);
+    ck_assert(ringfs_discard(&fs) == 0);
+    assert_scan_integrity(&fs);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 7);
+    ck_assert(ringfs_item_discard(&fs) == 0);
+    assert_scan_integrity(&fs);
+    ck_assert_int_eq(ringfs_count_exact(&fs), 6);
+
+    printf("## wraparound\n");
+    for (int i=0; i<100; i++) {
+        memset(record, i, sizeof(record));
+        ck_assert(ringfs_append_var(&fs, record, 1 + i % 64) == 0);
+    }
+    assert_scan_integrity(&fs);
+    int last = -1;
+    while (ringfs_fetch_var(&fs, record, &size) == 0) {
+        ck_assert_int_gt(record[0], last);
+        ck_assert_int_eq(size, 1 + record[0] % 64);
+        last = record[0];
+    }
+    ck_assert_int_eq(last, 99);
+
+    printf("## torn header closes the sector\n");
+    ck_assert(ringfs_discard(&fs) == 0);
+    ringfs_append_var(&fs, record, 4);
+    int address = (part.sector_offset + fs.write.sector) * part.sector_size +
+            fs.sector_header_size + fs.write.slot;
+    flashsim_program(sim, address, (uint8_t[]) { 0x00, 0xff, 0xff, 0xff, 0x34, 0x12, 0xff, 0xff }, 8);
+    struct ringfs fs2;
+    ringfs_init(&fs2, &part, DEFAULT_VERSION, 64);
+    ringfs_set_features(&fs2, RINGFS_FEATURE_VARIABLE);
+    ck_assert(ringfs_scan(&fs2) == 0);
+    ck_assert_int_eq(fs2.write.sector, (fs.write.sector + 1) % part.sector_count);
+    ck_assert_int_eq(fs2.write.slot, 0);
+    ck_assert(ringfs_append_var(&fs2, record, 8) == 0);
+    assert_scan_integrity(&fs2);
+    ck_assert(ringfs_fetch_var(&fs2, record, &size) == 0);
+    ck_assert_int_eq(size, 4);
+    ck_assert(ringfs_fetch_var(&fs2, record, &size) == 0);
+    ck_assert_int_eq(size, 8);
+    ck_assert(ringfs_fetch_var(&fs2, record, &size) < 0);
+
+    sim_close_scratch();
+}
+END_TEST
+
+START_TEST(test_ringfs_checkpoint)
+{
+    printf("# test_ringfs_checkpoint\n");
+
+    /* Many small sectors, with a one-sector checkpoint region in front. */
+    struct ringfs_flash_partition ring = flash;
+    ring.sector_offset = 1;
+    ring.sector_count = 64;
+    struct ringfs_flash_partition region = flash;
+    region.sector_offset = 0;
+    region.sector_count = 1;
+    sim_open_scratch("tests/checkpoint.sim", ring.sector_size * 65, ring.sector_size);
+
+    struct ringfs fs;
+    ringfs_init(&fs, &ring, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_set_checkpoint(&fs, &region);
+    ringfs_format(&fs);
+
+    int obj;
+    for (int round=0; round<4; round++) {
+        printf("## append, discard some, rescan using the checkpoint\n");
+        for (int i=0; i<70; i++)
+            ringfs_append(&fs, (int[]) { i });
+        for (int i=0; i<round*20; i++)
+            ck_assert(ringfs_fetch(&fs, &obj) == 0);
+        ringfs_discard(&fs);
+        read_calls = 0;
+        assert_scan_integrity(&fs);
+        int full_scan_reads = read_calls;
+
+        struct ringfs fs2;
+        ringfs_init(&fs2, &ring, DEFAULT_VERSION, sizeof(object_t));
+        ringfs_set_checkpoint(&fs2, &region);
+        read_calls = 0;
+        ck_assert(ringfs_scan(&fs2) == 0);
+        ck_assert_int_lt(read_calls, full_scan_reads - ring.sector_count / 2);
+        ck_assert(memcmp(&fs2.read, &fs.read, sizeof(fs.read)) == 0);
+        ck_assert(memcmp(&fs2.write, &fs.write, sizeof(fs.write)) == 0);
+    }
+
+    printf("## stale checkpoint falls back to a full scan\n");
+    struct ringfs plain;
+    ringfs_init(&plain, &ring, DEFAULT_VERSION, sizeof(object_t));
+    ck_assert(ringfs_scan(&plain) == 0);
+    for (int i=0; i<10; i++)
+        ringfs_append(&plain, (int[]) { i });
+
+    struct ringfs_sector_info table[64];
+    struct ringfs fs3;
+    ringfs_init(&fs3, &ring, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_set_checkpoint(&fs3, &region);
+    ringfs_set_sector_table(&fs3, table);
+    read_calls = 0;
+    ck_assert(ringfs_scan(&fs3) == 0);
+    ck_assert_int_ge(read_calls, ring.sector_count);
+    ck_assert(memcmp(&fs3.read, &plain.read, sizeof(plain.read)) == 0);
+    ck_assert(memcmp(&fs3.write, &plain.write, sizeof(plain.write)) == 0);
+
+    printf("## the fresh checkpoint is used next time, table included\n");
+    for (int i=0; i<10; i++)
+        ringfs_append(&fs3, (int[]) { i });
+    read_calls = 0;
+    assert_scan_integrity(&fs3);
+    int full_scan_reads = read_calls;
+    struct ringfs fs4;
+    ringfs_init(&fs4, &ring, DEFAULT_VERSION, sizeof(object_t));
+    ringfs_set_checkpoint(&fs4, &region);
+    ringfs_set_sector_table(&fs4, table);
+    read_calls = 0;
+    ck_assert(ringfs_scan(&fs4) == 0);
+    ck_assert_int_lt(read_calls, full_scan_reads - ring.sector_count / 2);
+    ck_assert(memcmp(&fs4.read, &fs3.read, sizeof(fs3.read)) == 0);
+    ck_assert(memcmp(&fs4.write, &fs3.write, sizeof(fs3.write)) == 0);
+    ck_assert_int_eq(ringfs_count_exact(&fs4), count_exact_walk(&fs4));
+    for (int i=0; i<200; i++)
+        ringfs_append(&fs4, (int[]) { i });
+    assert_scan_integrity(&fs4);
+
+    sim_close_scratch();
+}
+END_TEST
+
 Suite *ringfs_suite(void)
 {
     Suite *s = suite_create ("ringfs");
@@ -418,6 +2019,7 @@ Suite *ringfs_suite(void)
 
     tc = tcase_create("flashsim");
     tcase_add_test(tc, test_flashsim);
+    tcase_add_test(tc, test_flashsim_timing);
     suite_add_tcase(s, tc);
 
     tc = tcase_create("ringfs");
@@ -429,6 +2031,31 @@ Suite *ringfs_suite(void)
     tcase_add_test(tc, test_ringfs_capacity);
     tcase_add_test(tc, test_ringfs_count);
     tcase_add_test(tc, test_ringfs_overflow);
+    tcase_add_test(tc, test_ringfs_append_batch);
+    tcase_add_test(tc, test_ringfs_fetch_many);
+    tcase_add_test(tc, test_ringfs_peek);
+    tcase_add_test(tc, test_ringfs_background_erase);
+    tcase_add_test(tc, test_ringfs_reserve);
+    tcase_add_test(tc, test_ringfs_append_concurrent);
+    tcase_add_test(tc, test_ringfs_append_concurrent_failure);
+    tcase_add_test(tc, test_ringfs_consumers);
+    tcase_add_test(tc, test_ringfs_consumers_main_cursor);
+    tcase_add_test(tc, test_ringfs_sequence);
+    tcase_add_test(tc, test_ringfs_key_range);
+    tcase_add_test(tc, test_ringfs_wear);
+    tcase_add_test(tc, test_ringfs_coalesce);
+    tcase_add_test(tc, test_ringfs_program_unit);
+    tcase_add_test(tc, test_ringfs_read_cache);
+    tcase_add_test(tc, test_ringfs_stripe);
+#ifdef RINGFS_STATS
+    tcase_add_test(tc, test_ringfs_stats);
+#endif
+    tcase_add_test(tc, test_ringfs_sector_table);
+    tcase_add_test(tc, test_ringfs_count_table);
+    tcase_add_test(tc, test_ringfs_scan_large_sectors);
+    tcase_add_test(tc, test_ringfs_checkpoint);
+    tcase_add_test(tc, test_ringfs_discard_marks);
+    tcase_add_test(tc, test_ringfs_variable);
     suite_add_tcase(s, tc);
 
     return s;